@@ -0,0 +1,237 @@
+/*
+  ==============================================================================
+
+    BenchmarkMain.cpp
+    Headless benchmark for SoundfontAudioSource. Plays a fixed note and
+    controller script through the synth as fast as it can and reports how
+    long each block took. Needs no audio device or display. Build it with
+    "make -C Source/Benchmark".
+
+    Usage: JUCE-Soundfonts-Benchmark [options] [soundfont.sf2]
+      --seconds <n>     length of audio to render, at least one block (default 30)
+      --block <n>       samples per block (default 512)
+      --rate <n>        sample rate (default 44100)
+      --voices <n>      polyphony (default 256)
+      --threads <n>     render threads (default 1)
+      --split-channels  one synth per thread instead of splitting the voices
+      --coalesce        apply controller changes once per synth block
+
+  ==============================================================================
+*/
+
+#include "../SoundfontAudioSource.h"
+
+#if JUCE_LINUX || JUCE_MAC
+ #include <sys/resource.h>
+#endif
+
+#include <algorithm>
+#include <iostream>
+#include <vector>
+
+namespace
+{
+    struct Options
+    {
+        File soundfont;
+        double seconds = 30.0;
+        int blockSize = 512;
+        double sampleRate = 44100.0;
+        int voices = 256;
+        int threads = 1;
+        SoundfontAudioSource::RenderMode renderMode = SoundfontAudioSource::splitVoices;
+        bool coalesce = false;
+    };
+
+    bool parseOptions (const StringArray& args, Options& options)
+    {
+        for (int i = 0; i < args.size(); ++i) {
+            const String& arg = args[i];
+            const bool hasValue = i + 1 < args.size();
+
+            if (arg == "--seconds" && hasValue)         options.seconds = args[++i].getDoubleValue();
+            else if (arg == "--block" && hasValue)      options.blockSize = args[++i].getIntValue();
+            else if (arg == "--rate" && hasValue)       options.sampleRate = args[++i].getDoubleValue();
+            else if (arg == "--voices" && hasValue)     options.voices = args[++i].getIntValue();
+            else if (arg == "--threads" && hasValue)    options.threads = args[++i].getIntValue();
+            else if (arg == "--split-channels")         options.renderMode = SoundfontAudioSource::splitChannels;
+            else if (arg == "--coalesce")               options.coalesce = true;
+            else if (! arg.startsWith ("--"))           options.soundfont = File::getCurrentWorkingDirectory().getChildFile (arg);
+            else                                        return false;
+        }
+
+        // At least one whole block has to be rendered for the statistics to mean anything
+        return options.seconds > 0.0 && options.blockSize > 0 && options.sampleRate > 0.0
+                && options.seconds * options.sampleRate >= options.blockSize
+                && options.voices > 0 && options.threads > 0;
+    }
+
+    /** Looks for the bundled soundfonts from the usual places to run this. */
+    File findDefaultSoundfont()
+    {
+        const char* const candidates[] = { "Soundfonts", "../Soundfonts", "../../Soundfonts" };
+
+        for (const char* candidate : candidates) {
+            const File file = File::getCurrentWorkingDirectory().getChildFile (candidate)
+                                                                 .getChildFile ("Electric Piano.sf2");
+            if (file.existsAsFile()) {
+                return file;
+            }
+        }
+        return File();
+    }
+
+    /** The script: eight channels playing overlapping chords on 16th notes at
+        120bpm, with mod wheel sweeps, pitch bends, channel pressure and the
+        sustain pedal going up and down. The same samples always get the same
+        events, so runs can be compared. */
+    void addScriptEvents (MidiBuffer& midi, int64 blockStart, int numSamples, double sampleRate)
+    {
+        const int64 step = (int64) (sampleRate / 8.0);
+        const int numChannels = 8;
+        const int noteSteps = 6;
+
+        for (int i = 0; i < numSamples; ++i) {
+            const int64 time = blockStart + i;
+
+            if (time % step == 0) {
+                const int s = (int) (time / step);
+
+                for (int channel = 1; channel <= numChannels; ++channel) {
+                    if ((s + channel) % 2 != 0) {
+                        continue;
+                    }
+                    for (int n = 0; n < 3; ++n) {
+                        // Note-offs for what started noteSteps ago first, then the new chord
+                        const int oldNote = 36 + ((s - noteSteps) * 5 + channel * 7 + n * 4) % 48;
+                        if (s >= noteSteps) {
+                            midi.addEvent (MidiMessage::noteOff (channel, oldNote), i);
+                        }
+                        const int note = 36 + (s * 5 + channel * 7 + n * 4) % 48;
+                        midi.addEvent (MidiMessage::noteOn (channel, note, (uint8) (40 + (s * 13 + n * 29) % 88)), i);
+                    }
+                }
+
+                if (s % 32 == 0) {
+                    midi.addEvent (MidiMessage::controllerEvent (3, 64, (s / 32) % 2 == 0 ? 127 : 0), i);
+                }
+            }
+
+            if (time % 256 == 0) {
+                const int phase = (int) ((time / 256) % 256);
+                const int value = phase < 128 ? phase : 255 - phase;
+                for (int channel = 1; channel <= numChannels; ++channel) {
+                    midi.addEvent (MidiMessage::controllerEvent (channel, 1, value), i);
+                }
+                midi.addEvent (MidiMessage::channelPressureChange (4, value), i);
+            }
+
+            if (time % 512 == 0) {
+                const int phase = (int) ((time / 512) % 64);
+                midi.addEvent (MidiMessage::pitchWheel (2, 8192 + (phase < 32 ? phase : 63 - phase) * 128), i);
+            }
+        }
+    }
+
+    /** Peak resident memory of the process, in bytes, or 0 if unknown. */
+    int64 getPeakMemoryUsage()
+    {
+       #if JUCE_LINUX
+        struct rusage usage;
+        return getrusage (RUSAGE_SELF, &usage) == 0 ? (int64) usage.ru_maxrss * 1024 : 0;
+       #elif JUCE_MAC
+        struct rusage usage;
+        return getrusage (RUSAGE_SELF, &usage) == 0 ? (int64) usage.ru_maxrss : 0;
+       #else
+        return 0;
+       #endif
+    }
+}
+
+//==============================================================================
+int main (int argc, char* argv[])
+{
+    StringArray args;
+    for (int i = 1; i < argc; ++i) {
+        args.add (argv[i]);
+    }
+
+    Options options;
+    if (! parseOptions (args, options)) {
+        std::cerr << "Usage: JUCE-Soundfonts-Benchmark [--seconds n] [--block n] [--rate n]"
+                     " [--voices n] [--threads n] [--split-channels] [--coalesce] [soundfont.sf2]" << std::endl;
+        return 1;
+    }
+
+    if (options.soundfont == File()) {
+        options.soundfont = findDefaultSoundfont();
+    }
+    if (! options.soundfont.existsAsFile()) {
+        std::cerr << "Soundfont not found" << std::endl;
+        return 1;
+    }
+
+    SoundfontAudioSource source (options.voices, 1, options.threads, options.renderMode);
+    source.prepareToPlay (options.blockSize, options.sampleRate);
+    source.setControllerCoalescing (options.coalesce);
+
+    AudioBuffer<float> buffer (2, options.blockSize);
+    MidiBuffer midi;
+
+    // The soundfont loads on a background thread and is swapped in at the
+    // start of a block, so keep rendering silence until it's there
+    source.loadSoundfont (options.soundfont);
+
+    for (int attempts = 0; fluid_synth_sfcount (source.getSynth()) == 0; ++attempts) {
+        if (attempts == 10000) {
+            std::cerr << "Couldn't load " << options.soundfont.getFullPathName() << std::endl;
+            return 1;
+        }
+        source.renderNextBlock (buffer, midi, 0, options.blockSize);
+        Thread::sleep (1);
+    }
+
+    const int numBlocks = (int) (options.seconds * options.sampleRate / options.blockSize);
+    std::vector<double> blockTimes;
+    blockTimes.reserve ((size_t) numBlocks);
+
+    double totalTime = 0.0;
+    float peakLevel = 0.0f;
+
+    for (int block = 0; block < numBlocks; ++block) {
+        midi.clear();
+        addScriptEvents (midi, (int64) block * options.blockSize, options.blockSize, options.sampleRate);
+
+        const int64 start = Time::getHighResolutionTicks();
+        source.renderNextBlock (buffer, midi, 0, options.blockSize);
+        const double elapsed = Time::highResolutionTicksToSeconds (Time::getHighResolutionTicks() - start);
+
+        blockTimes.push_back (elapsed);
+        totalTime += elapsed;
+        peakLevel = jmax (peakLevel, buffer.getMagnitude (0, options.blockSize));
+    }
+
+    std::sort (blockTimes.begin(), blockTimes.end());
+
+    const double audioTime = (double) numBlocks * options.blockSize / options.sampleRate;
+    const double blockLength = options.blockSize / options.sampleRate;
+    const double mean = totalTime / numBlocks;
+    const double p99 = blockTimes[(size_t) ((numBlocks - 1) * 0.99)];
+    const double worst = blockTimes.back();
+
+    std::cout << "soundfont:        " << options.soundfont.getFileName() << std::endl
+              << "rendered:         " << String (audioTime, 1) << " s in " << numBlocks
+              << " blocks of " << options.blockSize << " samples at " << options.sampleRate << " Hz" << std::endl
+              << "threads:          " << options.threads
+              << (options.renderMode == SoundfontAudioSource::splitChannels ? " (split channels)" : " (split voices)")
+              << (options.coalesce ? ", coalesced controllers" : "") << std::endl
+              << "block time (us):  mean " << String (mean * 1.0e6, 1)
+              << ", p99 " << String (p99 * 1.0e6, 1)
+              << ", max " << String (worst * 1.0e6, 1)
+              << " (budget " << String (blockLength * 1.0e6, 1) << ")" << std::endl
+              << "real-time factor: " << String (audioTime / totalTime, 2) << "x" << std::endl
+              << "peak level:       " << String (peakLevel, 3) << std::endl
+              << "peak memory:      " << String (getPeakMemoryUsage() / (1024.0 * 1024.0), 1) << " MB" << std::endl;
+
+    return 0;
+}
@@ -110,9 +110,21 @@ struct _fluid_sfont_t {
 
   /* return 0 when no more presets are available, 1 otherwise */
   int (*iteration_next)(fluid_sfont_t* sfont, fluid_preset_t* preset);
+
+  /** Count the number of playing voices that were started from this
+      SoundFont. Maintained by the synthesizer, loaders set it to zero. */
+  unsigned int refcount;
+
+  /** Preset handles that 'get_preset' may return instead of allocating
+      new ones, so that program changes don't allocate. They belong to
+      this sfont and their 'free' callback is NULL. Loaders that don't
+      use them set 'presets' to NULL. */
+  fluid_preset_t* presets;
+  unsigned int preset_count;
 };
 
 #define fluid_sfont_get_id(_sf) ((_sf)->id)
+#define fluid_sfont_refcount(_sf) ((_sf)->refcount)
 
 
 /*
@@ -246,6 +246,56 @@ FLUIDSYNTH_API int fluid_synth_add_sfont(fluid_synth_t* synth, fluid_sfont_t* sf
   */
 FLUIDSYNTH_API void fluid_synth_remove_sfont(fluid_synth_t* synth, fluid_sfont_t* sfont);
 
+  /** Load a SoundFont without adding it to the synthesizer. Only the
+   *  synthesizer's loaders are used, its state is left alone, so this
+   *  can be called from a background thread while another thread is
+   *  rendering. Only one thread should load at a time. Add the result
+   *  with fluid_synth_add_sfont() or fluid_synth_swap_sfont(), or
+   *  delete it with its free() callback.
+
+      \param synth The synthesizer object
+      \param filename The file name
+      \returns The new SoundFont, or NULL in case of error
+  */
+FLUIDSYNTH_API fluid_sfont_t* fluid_synth_load_sfont(fluid_synth_t* synth, const char* filename);
+
+  /** Create a new handle onto a loaded SoundFont, so that several
+   *  synthesizers can play the same samples and presets without
+   *  loading them twice. Each handle gets its own ID, voice count and
+   *  preset handles in the synthesizer it is added to. Freeing a handle with its
+   *  free() callback leaves the shared data alone; the original must
+   *  outlive all of its handles. The preset iterator is shared too,
+   *  so don't iterate from several threads at once.
+
+      \param sfont The SoundFont to share
+      \returns The new handle, or NULL in case of error
+  */
+FLUIDSYNTH_API fluid_sfont_t* fluid_synth_share_sfont(fluid_sfont_t* sfont);
+
+  /** Replace a SoundFont with another one. The new SoundFont takes the
+   *  old one's position on the stack and its bank offset, and gets a
+   *  new ID. The channels are then pointed at the new SoundFont's
+   *  presets. The default loader makes those preset handles when it
+   *  loads the file, so with its SoundFonts no memory is allocated or
+   *  freed and this is safe to call between two blocks on the audio
+   *  thread. Other loaders may allocate in their get_preset callback.
+   *  Voices already playing from the old SoundFont keep playing. The
+   *  old SoundFont is not deleted; this is the responsability of the
+   *  caller, once fluid_sfont_refcount() has dropped to zero. If
+   *  old_sfont is NULL, the new SoundFont is pushed on the stack as
+   *  with fluid_synth_add_sfont(). The synthesizer keeps one list node
+   *  aside for this, and gets it back when a SoundFont is removed, so
+   *  that doesn't allocate either unless it happens twice in a row.
+
+      \param synth The synthesizer object
+      \param old_sfont The SoundFont to replace, or NULL
+      \param new_sfont The replacement
+      \param reset_presets If TRUE then presets will be reset for all channels
+      \returns The ID of the new SoundFont, or -1 in case of error
+  */
+FLUIDSYNTH_API int fluid_synth_swap_sfont(fluid_synth_t* synth, fluid_sfont_t* old_sfont,
+					  fluid_sfont_t* new_sfont, int reset_presets);
+
   /** Count the number of loaded SoundFonts.
 
       \param synth The synthesizer object
@@ -390,6 +440,41 @@ FLUIDSYNTH_API int fluid_synth_set_polyphony(fluid_synth_t* synth, int polyphony
   /** Get the polyphony limit (FluidSynth >= 1.0.6) */
 FLUIDSYNTH_API int fluid_synth_get_polyphony(fluid_synth_t* synth);
 
+  /** Get the number of voices that may still be playing. Voices that
+      have finished are only counted out during the next block, so this
+      can be a little high. Call it from the thread that renders. */
+FLUIDSYNTH_API int fluid_synth_get_active_voice_count(fluid_synth_t* synth);
+
+  /** Hold controller, pitch bend and channel pressure changes back
+      until the next block is rendered, and then apply only the last
+      value of each. Parameters only move once per block anyway, so
+      this sounds the same while saving the work for all the
+      intermediate values of a fast controller. Off by default; the
+      "synth.coalesce-controllers" setting sets it for a new synth. */
+FLUIDSYNTH_API void fluid_synth_set_coalesce_controllers(fluid_synth_t* synth, int coalesce);
+
+  /** Whether controller changes are held back to the next block */
+FLUIDSYNTH_API int fluid_synth_get_coalesce_controllers(fluid_synth_t* synth);
+
+  /** Have note-ons and note-offs, and the hard stop of all sounds
+      off, take effect offset frames into the next block rendered,
+      rather than at its start. A caller that renders up to each event
+      can pass the event's position within the block, and have the
+      timing exact at the cost of one block of latency. Note-ons,
+      stops and the releases of note-offs, sustain pedal and all
+      notes off are exact to the frame. The envelopes still step per
+      block, so a released voice holds its amplitude up to the frame
+      and ramps towards the release from there. A
+      negative offset follows the synth's own read position, for
+      callers that don't keep track of it; 0, the default, is the
+      start of the block. The "synth.event-offset" setting sets it for
+      a new synth. */
+FLUIDSYNTH_API void fluid_synth_set_event_offset(fluid_synth_t* synth, int offset);
+
+  /** The offset events take effect at, -1 when it follows the read
+      position */
+FLUIDSYNTH_API int fluid_synth_get_event_offset(fluid_synth_t* synth);
+
   /** Get the internal buffer size. The internal buffer size if not the
       same thing as the buffer size specified in the
       settings. Internally, the synth *always* uses a specific buffer
@@ -634,6 +719,75 @@ FLUIDSYNTH_API int fluid_synth_write_float(fluid_synth_t* synth, int len,
 					 void* lout, int loff, int lincr, 
 					 void* rout, int roff, int rincr);
 
+  /** Generate a number of samples into two separate, contiguous
+   *  channel buffers. Produces the same output as
+   *  fluid_synth_write_float() with an increment of 1, but whole
+   *  blocks are rendered straight into the output; only the partial
+   *  blocks at the start and end go through the internal buffers.
+   *
+   *  \param synth The synthesizer
+   *  \param len The number of samples to generate
+   *  \param left The sample buffer for the left channel
+   *  \param right The sample buffer for the right channel
+   *  \returns 0 if no error occured, non-zero otherwise
+   */
+FLUIDSYNTH_API int fluid_synth_write_float_direct(fluid_synth_t* synth, int len,
+						float* left, float* right);
+
+  /** Generate a number of samples into several stereo buses, one per
+   *  audio group (see the "synth.audio-groups" setting). Like
+   *  fluid_synth_write_float_direct(), whole blocks are rendered
+   *  straight into the output, and nothing is allocated. The reverb
+   *  and chorus are mixed into the first bus. Outputs beyond the
+   *  synth's buses are filled with silence.
+   *
+   *  \param synth The synthesizer
+   *  \param len The number of samples to generate
+   *  \param nout The number of output buffers, two per bus
+   *  \param out The output buffers: left and right of bus 0, then of bus 1, etc.
+   *  \returns 0 if no error occured, non-zero otherwise
+   */
+FLUIDSYNTH_API int fluid_synth_write_float_buses(fluid_synth_t* synth, int len,
+					       int nout, float** out);
+
+  /** Like fluid_synth_write_float_buses(), but leaves the reverb and
+   *  chorus out: their send signals are written to reverb_send and
+   *  chorus_send instead (either may be NULL). The sends of several
+   *  synths can be summed and run through one set of effects with
+   *  fluid_synth_mix_fx(). Don't switch between this and the other
+   *  write functions in the middle of a block.
+   *
+   *  \param synth The synthesizer
+   *  \param len The number of samples to generate
+   *  \param nout The number of output buffers, two per bus
+   *  \param out The dry output buffers, laid out as for fluid_synth_write_float_buses()
+   *  \param reverb_send The reverb send signal
+   *  \param chorus_send The chorus send signal
+   *  \returns 0 if no error occured, non-zero otherwise
+   */
+FLUIDSYNTH_API int fluid_synth_write_float_sends(fluid_synth_t* synth, int len,
+					       int nout, float** out,
+					       float* reverb_send, float* chorus_send);
+
+  /** Runs reverb and chorus send signals through the synth's effects
+   *  and mixes the result into left and right. The effects work on
+   *  whole blocks, so len must be a multiple of
+   *  fluid_synth_get_internal_bufsize(), and the sends should come
+   *  from fluid_synth_write_float_sends() calls that start on a block
+   *  boundary.
+   *
+   *  \param synth The synthesizer whose reverb and chorus are used
+   *  \param len The number of samples to process
+   *  \param reverb_send The reverb send signal, or NULL
+   *  \param chorus_send The chorus send signal, or NULL
+   *  \param left The left channel to mix into
+   *  \param right The right channel to mix into
+   *  \returns 0, or -1 if len isn't a whole number of blocks
+   */
+FLUIDSYNTH_API int fluid_synth_mix_fx(fluid_synth_t* synth, int len,
+				    float* reverb_send, float* chorus_send,
+				    float* left, float* right);
+
 FLUIDSYNTH_API int fluid_synth_nwrite_float(fluid_synth_t* synth, int len, 
 					  float** left, float** right, 
 					  float** fx_left, float** fx_right);
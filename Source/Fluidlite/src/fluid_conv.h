@@ -50,6 +50,7 @@ fluid_real_t fluid_hz2ct(fluid_real_t c);
 fluid_real_t fluid_pan(fluid_real_t c, int left);
 fluid_real_t fluid_concave(fluid_real_t val);
 fluid_real_t fluid_convex(fluid_real_t val);
+void fluid_sincos(const fluid_real_t* x, fluid_real_t* sin_x, fluid_real_t* cos_x, int count);
 
 extern fluid_real_t fluid_ct2hz_tab[FLUID_CENTS_HZ_SIZE];
 extern fluid_real_t fluid_vel2cb_tab[FLUID_VEL_CB_SIZE];
@@ -23,6 +23,7 @@
 
 
 #include "fluid_defsfont.h"
+#include "fluid_voice.h"
 /* Todo: Get rid of that 'include' */
 #include "fluid_sys.h"
 
@@ -41,8 +42,6 @@ struct VorbisData {
     int datasize;
 };
 
-static struct VorbisData vorbisData;
-
 static size_t ovRead(void* ptr, size_t size, size_t nmemb, void* datasource);
 static int ovSeek(void* datasource, ogg_int64_t offset, int whence);
 static long ovTell(void* datasource);
@@ -130,10 +129,14 @@ int delete_fluid_defsfloader(fluid_sfloader_t* loader)
   return FLUID_OK;
 }
 
+static void fluid_defsfont_init_preset(fluid_sfont_t* sfont, fluid_preset_t* preset,
+				       fluid_defpreset_t* defpreset);
+
 fluid_sfont_t* fluid_defsfloader_load(fluid_sfloader_t* loader, const char* filename)
 {
   fluid_defsfont_t* defsfont;
   fluid_sfont_t* sfont;
+  int i;
 
   defsfont = new_fluid_defsfont();
 
@@ -148,6 +151,9 @@ fluid_sfont_t* fluid_defsfloader_load(fluid_sfloader_t* loader, const char* file
   }
 
   sfont->data = defsfont;
+  sfont->refcount = 0;
+  sfont->presets = NULL;
+  sfont->preset_count = 0;
   sfont->free = fluid_defsfont_sfont_delete;
   sfont->get_name = fluid_defsfont_sfont_get_name;
   sfont->get_preset = fluid_defsfont_sfont_get_preset;
@@ -156,9 +162,26 @@ fluid_sfont_t* fluid_defsfloader_load(fluid_sfloader_t* loader, const char* file
 
   if (fluid_defsfont_load(defsfont, filename) == FLUID_FAILED) {
     delete_fluid_defsfont(defsfont);
+    if (loader->data == NULL) {
+      FLUID_FREE(sfont);
+    }
     return NULL;
   }
 
+  /* Make one preset handle for every preset up front, so that
+     get_preset doesn't have to allocate. Without them it falls back
+     to allocating. */
+  sfont->presets = FLUID_ARRAY(fluid_preset_t, defsfont->preset_count + 1);
+  if (sfont->presets == NULL) {
+    FLUID_LOG(FLUID_WARN, "Out of memory, presets will be allocated on program changes");
+  } else {
+    sfont->preset_count = defsfont->preset_count;
+    for (i = 0; i < defsfont->preset_count; i++) {
+      fluid_defsfont_init_preset(sfont, &sfont->presets[i], defsfont->preset_table[i]);
+      sfont->presets[i].free = NULL;
+    }
+  }
+
   return sfont;
 }
 
@@ -174,6 +197,9 @@ int fluid_defsfont_sfont_delete(fluid_sfont_t* sfont)
   if (delete_fluid_defsfont(sfont->data) != 0) {
     return -1;
   }
+  if (sfont->presets != NULL) {
+    FLUID_FREE(sfont->presets);
+  }
   FLUID_FREE(sfont);
   return 0;
 }
@@ -183,32 +209,49 @@ char* fluid_defsfont_sfont_get_name(fluid_sfont_t* sfont)
   return fluid_defsfont_get_name((fluid_defsfont_t*) sfont->data);
 }
 
+/*
+ * fluid_defsfont_init_preset
+ *
+ * Fills in a preset handle for one of the presets of the sfont.
+ */
+static void
+fluid_defsfont_init_preset(fluid_sfont_t* sfont, fluid_preset_t* preset, fluid_defpreset_t* defpreset)
+{
+  preset->sfont = sfont;
+  preset->data = defpreset;
+  preset->free = fluid_defpreset_preset_delete;
+  preset->get_name = fluid_defpreset_preset_get_name;
+  preset->get_banknum = fluid_defpreset_preset_get_banknum;
+  preset->get_num = fluid_defpreset_preset_get_num;
+  preset->noteon = fluid_defpreset_preset_noteon;
+  preset->notify = NULL;
+}
+
 fluid_preset_t*
 fluid_defsfont_sfont_get_preset(fluid_sfont_t* sfont, unsigned int bank, unsigned int prenum)
 {
   fluid_preset_t* preset;
-  fluid_defpreset_t* defpreset;
+  fluid_defsfont_t* defsfont = (fluid_defsfont_t*) sfont->data;
+  int index;
 
-  defpreset = fluid_defsfont_get_preset((fluid_defsfont_t*) sfont->data, bank, prenum);
+  index = fluid_defsfont_find_preset(defsfont, bank, prenum);
 
-  if (defpreset == NULL) {
+  if (index < 0) {
     return NULL;
   }
 
+  /* the preset handles made at load time don't need to be freed */
+  if (sfont->presets != NULL) {
+    return &sfont->presets[index];
+  }
+
   preset = FLUID_NEW(fluid_preset_t);
   if (preset == NULL) {
     FLUID_LOG(FLUID_ERR, "Out of memory");
     return NULL;
   }
 
-  preset->sfont = sfont;
-  preset->data = defpreset;
-  preset->free = fluid_defpreset_preset_delete;
-  preset->get_name = fluid_defpreset_preset_get_name;
-  preset->get_banknum = fluid_defpreset_preset_get_banknum;
-  preset->get_num = fluid_defpreset_preset_get_num;
-  preset->noteon = fluid_defpreset_preset_noteon;
-  preset->notify = NULL;
+  fluid_defsfont_init_preset(sfont, preset, defsfont->preset_table[index]);
 
   return preset;
 }
@@ -287,6 +330,10 @@ fluid_defsfont_t* new_fluid_defsfont()
   sfont->sample = NULL;
   sfont->sampledata = NULL;
   sfont->preset = NULL;
+  sfont->preset_count = 0;
+  sfont->preset_table = NULL;
+  sfont->preset_hash = NULL;
+  sfont->preset_hash_bits = 0;
 
   return sfont;
 }
@@ -331,6 +378,14 @@ int delete_fluid_defsfont(fluid_defsfont_t* sfont)
     preset = sfont->preset;
   }
 
+  if (sfont->preset_table != NULL) {
+    FLUID_FREE(sfont->preset_table);
+  }
+
+  if (sfont->preset_hash != NULL) {
+    FLUID_FREE(sfont->preset_hash);
+  }
+
   FLUID_FREE(sfont);
   return FLUID_OK;
 }
@@ -414,6 +469,10 @@ int fluid_defsfont_load(fluid_defsfont_t* sfont, const char* file)
     if(preset_callback) preset_callback(preset->bank,preset->num,preset->name);
     p = fluid_list_next(p);
   }
+
+  if (fluid_defsfont_index_presets(sfont) != FLUID_OK)
+    goto err_exit;
+
   sfont_close (sfdata);
 
   return FLUID_OK;
@@ -538,6 +597,7 @@ fluid_sample_t* fluid_defsfont_get_sample(fluid_defsfont_t* sfont, char *s)
             int sampledata_size=0;
 
             OggVorbis_File vf;
+            struct VorbisData vorbisData;
             vorbisData.pos  = 0;
             vorbisData.data = (char*)sample->data+sample->start;
             vorbisData.datasize = (sample->end + 1 - sample->start);
@@ -595,18 +655,103 @@ fluid_sample_t* fluid_defsfont_get_sample(fluid_defsfont_t* sfont, char *s)
 }
 
 /*
- * fluid_defsfont_get_preset
+ * fluid_defsfont_preset_hash
  */
-fluid_defpreset_t* fluid_defsfont_get_preset(fluid_defsfont_t* sfont, unsigned int bank, unsigned int num)
+#define fluid_defsfont_preset_hash(_bank, _num, _bits) \
+  ((((((_bank) << 7) ^ (_num)) * 2654435761u) >> (32 - (_bits))) & ((1u << (_bits)) - 1))
+
+/*
+ * fluid_defsfont_index_presets
+ *
+ * Numbers the presets in list order and builds the hash table that
+ * maps a bank and preset number to that index. When a font has the
+ * same bank and preset number twice, the first one in the list wins,
+ * like it does in a linear search.
+ */
+int fluid_defsfont_index_presets(fluid_defsfont_t* sfont)
 {
-  fluid_defpreset_t* preset = sfont->preset;
-  while (preset != NULL) {
-    if ((preset->bank == bank) && ((preset->num == num))) {
-      return preset;
+  fluid_defpreset_t* preset;
+  unsigned int slot, mask;
+  int count, i, k;
+
+  count = 0;
+  for (preset = sfont->preset; preset != NULL; preset = preset->next) {
+    count++;
+  }
+
+  /* keep the table at most half full */
+  sfont->preset_hash_bits = 4;
+  while ((1 << sfont->preset_hash_bits) < 2 * count) {
+    sfont->preset_hash_bits++;
+  }
+  mask = (1u << sfont->preset_hash_bits) - 1;
+
+  sfont->preset_table = FLUID_ARRAY(fluid_defpreset_t*, count + 1);
+  sfont->preset_hash = FLUID_ARRAY(int, mask + 1);
+  if ((sfont->preset_table == NULL) || (sfont->preset_hash == NULL)) {
+    FLUID_LOG(FLUID_ERR, "Out of memory");
+    return FLUID_FAILED;
+  }
+  for (slot = 0; slot <= mask; slot++) {
+    sfont->preset_hash[slot] = -1;
+  }
+
+  i = 0;
+  for (preset = sfont->preset; preset != NULL; preset = preset->next) {
+    sfont->preset_table[i] = preset;
+
+    slot = fluid_defsfont_preset_hash(preset->bank, preset->num, sfont->preset_hash_bits);
+    while ((k = sfont->preset_hash[slot]) >= 0) {
+      if ((sfont->preset_table[k]->bank == preset->bank)
+	  && (sfont->preset_table[k]->num == preset->num)) {
+	break;
+      }
+      slot = (slot + 1) & mask;
     }
-    preset = preset->next;
+    if (k < 0) {
+      sfont->preset_hash[slot] = i;
+    }
+    i++;
   }
-  return NULL;
+  sfont->preset_count = count;
+
+  return FLUID_OK;
+}
+
+/*
+ * fluid_defsfont_find_preset
+ *
+ * Returns the index of a preset, or -1 if the font doesn't have it.
+ */
+int fluid_defsfont_find_preset(fluid_defsfont_t* sfont, unsigned int bank, unsigned int num)
+{
+  fluid_defpreset_t* preset;
+  unsigned int slot, mask;
+  int k;
+
+  if (sfont->preset_hash == NULL) {
+    return -1;
+  }
+
+  mask = (1u << sfont->preset_hash_bits) - 1;
+  slot = fluid_defsfont_preset_hash(bank, num, sfont->preset_hash_bits);
+  while ((k = sfont->preset_hash[slot]) >= 0) {
+    preset = sfont->preset_table[k];
+    if ((preset->bank == bank) && (preset->num == num)) {
+      return k;
+    }
+    slot = (slot + 1) & mask;
+  }
+  return -1;
+}
+
+/*
+ * fluid_defsfont_get_preset
+ */
+fluid_defpreset_t* fluid_defsfont_get_preset(fluid_defsfont_t* sfont, unsigned int bank, unsigned int num)
+{
+  int index = fluid_defsfont_find_preset(sfont, bank, num);
+  return (index < 0) ? NULL : sfont->preset_table[index];
 }
 
 /*
@@ -654,6 +799,9 @@ new_fluid_defpreset(fluid_defsfont_t* sfont)
   preset->num = 0;
   preset->global_zone = NULL;
   preset->zone = NULL;
+  preset->pair = NULL;
+  FLUID_MEMSET(preset->key_first, 0, sizeof(preset->key_first));
+  preset->key_pair = NULL;
   return preset;
 }
 
@@ -665,6 +813,16 @@ delete_fluid_defpreset(fluid_defpreset_t* preset)
 {
   int err = FLUID_OK;
   fluid_preset_zone_t* zone;
+  fluid_zone_pair_t* pair;
+  if (preset->key_pair != NULL) {
+    FLUID_FREE(preset->key_pair);
+    preset->key_pair = NULL;
+  }
+  while (preset->pair != NULL) {
+    pair = preset->pair;
+    preset->pair = pair->next;
+    delete_fluid_zone_pair(pair);
+  }
   if (preset->global_zone != NULL) {
     if (delete_fluid_preset_zone(preset->global_zone) != FLUID_OK) {
       err = FLUID_FAILED;
@@ -717,223 +875,29 @@ fluid_defpreset_next(fluid_defpreset_t* preset)
 int
 fluid_defpreset_noteon(fluid_defpreset_t* preset, fluid_synth_t* synth, int chan, int key, int vel)
 {
-  fluid_preset_zone_t *preset_zone, *global_preset_zone;
-  fluid_inst_t* inst;
-  fluid_inst_zone_t *inst_zone, *global_inst_zone, *z;
-  fluid_sample_t* sample;
-  fluid_voice_t* voice;
-  fluid_mod_t * mod;
-  fluid_mod_t * mod_list[FLUID_NUM_MOD]; /* list for 'sorting' preset modulators */
-  int mod_list_count;
+  fluid_zone_pair_t* pair;
   int i;
 
-  global_preset_zone = fluid_defpreset_get_global_zone(preset);
-
-  /* run thru all the zones of this preset */
-  preset_zone = fluid_defpreset_get_zone(preset);
-  while (preset_zone != NULL) {
-
-    /* check if the note falls into the key and velocity range of this
-       preset */
-    if (fluid_preset_zone_inside_range(preset_zone, key, vel)) {
-
-      inst = fluid_preset_zone_get_inst(preset_zone);
-      global_inst_zone = fluid_inst_get_global_zone(inst);
-
-      /* run thru all the zones of this instrument */
-      inst_zone = fluid_inst_get_zone(inst);
-	  while (inst_zone != NULL) {
-
-	/* make sure this instrument zone has a valid sample */
-	sample = fluid_inst_zone_get_sample(inst_zone);
-	if (fluid_sample_in_rom(sample) || (sample == NULL)) {
-	  inst_zone = fluid_inst_zone_next(inst_zone);
-	  continue;
-	}
-
-	/* check if the note falls into the key and velocity range of this
-	   instrument */
-
-	if (fluid_inst_zone_inside_range(inst_zone, key, vel) && (sample != NULL)) {
-
-	  /* this is a good zone. allocate a new synthesis process and
-             initialize it */
-
-	  voice = fluid_synth_alloc_voice(synth, sample, chan, key, vel);
-	  if (voice == NULL) {
-	    return FLUID_FAILED;
-	  }
-
-
-	  z = inst_zone;
-
-	  /* Instrument level, generators */
-
-	  for (i = 0; i < GEN_LAST; i++) {
-
-	    /* SF 2.01 section 9.4 'bullet' 4:
-	     *
-	     * A generator in a local instrument zone supersedes a
-	     * global instrument zone generator.  Both cases supersede
-	     * the default generator -> voice_gen_set */
-
-	    if (inst_zone->gen[i].flags){
-	      fluid_voice_gen_set(voice, i, inst_zone->gen[i].val);
-
-	    } else if ((global_inst_zone != NULL) && (global_inst_zone->gen[i].flags)) {
-	      fluid_voice_gen_set(voice, i, global_inst_zone->gen[i].val);
-
-	    } else {
-	      /* The generator has not been defined in this instrument.
-	       * Do nothing, leave it at the default.
-	       */
-	    }
-
-	  } /* for all generators */
-
-	  /* global instrument zone, modulators: Put them all into a
-	   * list. */
-
-	  mod_list_count = 0;
-
-	  if (global_inst_zone){
-	    mod = global_inst_zone->mod;
-	    while (mod){
-	      mod_list[mod_list_count++] = mod;
-	      mod = mod->next;
-	    }
-	  }
-
-	  /* local instrument zone, modulators.
-	   * Replace modulators with the same definition in the list:
-	   * SF 2.01 page 69, 'bullet' 8
-	   */
-	  mod = inst_zone->mod;
-
-	  while (mod){
-
-	    /* 'Identical' modulators will be deleted by setting their
-	     *  list entry to NULL.  The list length is known, NULL
-	     *  entries will be ignored later.  SF2.01 section 9.5.1
-	     *  page 69, 'bullet' 3 defines 'identical'.  */
-
-	    for (i = 0; i < mod_list_count; i++){
-	      if (mod_list[i] && fluid_mod_test_identity(mod,mod_list[i])){
-		mod_list[i] = NULL;
-	      }
-	    }
-
-	    /* Finally add the new modulator to to the list. */
-	    mod_list[mod_list_count++] = mod;
-	    mod = mod->next;
-	  }
-
-	  /* Add instrument modulators (global / local) to the voice. */
-	  for (i = 0; i < mod_list_count; i++){
-
-	    mod = mod_list[i];
-
-	    if (mod != NULL){ /* disabled modulators CANNOT be skipped. */
-
-	      /* Instrument modulators -supersede- existing (default)
-	       * modulators.  SF 2.01 page 69, 'bullet' 6 */
-	      fluid_voice_add_mod(voice, mod, FLUID_VOICE_OVERWRITE);
-	    }
-	  }
-
-	  /* Preset level, generators */
-
-	  for (i = 0; i < GEN_LAST; i++) {
-
-	    /* SF 2.01 section 8.5 page 58: If some generators are
-	     * encountered at preset level, they should be ignored */
-	    if ((i != GEN_STARTADDROFS)
-		&& (i != GEN_ENDADDROFS)
-		&& (i != GEN_STARTLOOPADDROFS)
-		&& (i != GEN_ENDLOOPADDROFS)
-		&& (i != GEN_STARTADDRCOARSEOFS)
-		&& (i != GEN_ENDADDRCOARSEOFS)
-		&& (i != GEN_STARTLOOPADDRCOARSEOFS)
-		&& (i != GEN_KEYNUM)
-		&& (i != GEN_VELOCITY)
-		&& (i != GEN_ENDLOOPADDRCOARSEOFS)
-		&& (i != GEN_SAMPLEMODE)
-		&& (i != GEN_EXCLUSIVECLASS)
-		&& (i != GEN_OVERRIDEROOTKEY)) {
-
-	      /* SF 2.01 section 9.4 'bullet' 9: A generator in a
-	       * local preset zone supersedes a global preset zone
-	       * generator.  The effect is -added- to the destination
-	       * summing node -> voice_gen_incr */
-
-	      if (preset_zone->gen[i].flags) {
-		fluid_voice_gen_incr(voice, i, preset_zone->gen[i].val);
-	      } else if ((global_preset_zone != NULL) && global_preset_zone->gen[i].flags) {
-		fluid_voice_gen_incr(voice, i, global_preset_zone->gen[i].val);
-	      } else {
-		/* The generator has not been defined in this preset
-		 * Do nothing, leave it unchanged.
-		 */
-	      }
-	    } /* if available at preset level */
-	  } /* for all generators */
-
-
-	  /* Global preset zone, modulators: put them all into a
-	   * list. */
-	  mod_list_count = 0;
-	  if (global_preset_zone){
-	    mod = global_preset_zone->mod;
-	    while (mod){
-	      mod_list[mod_list_count++] = mod;
-	      mod = mod->next;
-	    }
-	  }
-
-	  /* Process the modulators of the local preset zone.  Kick
-	   * out all identical modulators from the global preset zone
-	   * (SF 2.01 page 69, second-last bullet) */
-
-	  mod = preset_zone->mod;
-	  while (mod){
-	    for (i = 0; i < mod_list_count; i++){
-	      if (mod_list[i] && fluid_mod_test_identity(mod,mod_list[i])){
-		mod_list[i] = NULL;
-	      }
-	    }
-
-	    /* Finally add the new modulator to the list. */
-	    mod_list[mod_list_count++] = mod;
-	    mod = mod->next;
-	  }
-
-	  /* Add preset modulators (global / local) to the voice. */
-	  for (i = 0; i < mod_list_count; i++){
-	    mod = mod_list[i];
-	    if ((mod != NULL) && (mod->amount != 0)) { /* disabled modulators can be skipped. */
-
-	      /* Preset modulators -add- to existing instrument /
-	       * default modulators.  SF2.01 page 70 first bullet on
-	       * page */
-	      fluid_voice_add_mod(voice, mod, FLUID_VOICE_ADD);
-	    }
-	  }
-
-	  /* add the synthesis process to the synthesis loop. */
-	  fluid_synth_start_voice(synth, voice);
-
-	  /* Store the ID of the first voice that was created by this noteon event.
-	   * Exclusive class may only terminate older voices.
-	   * That avoids killing voices, which have just been created.
-	   * (a noteon event can create several voice processes with the same exclusive
-	   * class - for example when using stereo samples)
-	   */
-	}
-
-	inst_zone = fluid_inst_zone_next(inst_zone);
+  /* Keys outside of the MIDI range aren't in the key index, run
+     thru all the zone pairs of this preset */
+  if ((key < 0) || (key > 127)) {
+    for (pair = preset->pair; pair != NULL; pair = pair->next) {
+      if (fluid_zone_pair_inside_range(pair, key, vel)
+	  && (fluid_zone_pair_noteon(pair, synth, chan, key, vel) != FLUID_OK)) {
+	return FLUID_FAILED;
       }
-	}
-    preset_zone = fluid_preset_zone_next(preset_zone);
+    }
+    return FLUID_OK;
+  }
+
+  /* The index only holds the pairs whose key range covers the key,
+     check the velocity range of those */
+  for (i = preset->key_first[key]; i < preset->key_first[key + 1]; i++) {
+    pair = preset->key_pair[i];
+    if ((pair->vello <= vel) && (pair->velhi >= vel)
+	&& (fluid_zone_pair_noteon(pair, synth, chan, key, vel) != FLUID_OK)) {
+      return FLUID_FAILED;
+    }
   }
 
   return FLUID_OK;
@@ -989,6 +953,116 @@ fluid_defpreset_import_sfont(fluid_defpreset_t* preset,
     p = fluid_list_next(p);
     count++;
   }
+  return fluid_defpreset_compile(preset);
+}
+
+/*
+ * fluid_defpreset_compile
+ *
+ * Builds the zone pairs that fluid_defpreset_noteon walks, one for
+ * every instrument zone with a usable sample in every preset zone.
+ * The pairs keep the order in which the zones used to be visited.
+ * The two halves of a stereo sample become one pair, see
+ * fluid_zone_pair_link_stereo().
+ */
+int
+fluid_defpreset_compile(fluid_defpreset_t* preset)
+{
+  fluid_preset_zone_t* preset_zone;
+  fluid_inst_t* inst;
+  fluid_inst_zone_t *inst_zone, *global_inst_zone;
+  fluid_sample_t* sample;
+  fluid_zone_pair_t *pair, *last = NULL;
+
+  for (preset_zone = fluid_defpreset_get_zone(preset);
+       preset_zone != NULL;
+       preset_zone = fluid_preset_zone_next(preset_zone)) {
+
+    inst = fluid_preset_zone_get_inst(preset_zone);
+    if (inst == NULL) {
+      continue;
+    }
+    global_inst_zone = fluid_inst_get_global_zone(inst);
+
+    for (inst_zone = fluid_inst_get_zone(inst);
+	 inst_zone != NULL;
+	 inst_zone = fluid_inst_zone_next(inst_zone)) {
+
+      /* make sure this instrument zone has a valid sample */
+      sample = fluid_inst_zone_get_sample(inst_zone);
+      if ((sample == NULL) || fluid_sample_in_rom(sample)) {
+	continue;
+      }
+
+      pair = new_fluid_zone_pair(preset->global_zone, preset_zone,
+				 global_inst_zone, inst_zone);
+      if (pair == NULL) {
+	return FLUID_FAILED;
+      }
+
+      /* zones that can never be hit together are dropped */
+      if ((pair->keylo > pair->keyhi) || (pair->vello > pair->velhi)) {
+	delete_fluid_zone_pair(pair);
+	continue;
+      }
+
+      if ((last != NULL) && fluid_zone_pair_link_stereo(last, pair)) {
+	delete_fluid_zone_pair(pair);
+	continue;
+      }
+
+      if (last == NULL) {
+	preset->pair = pair;
+      } else {
+	last->next = pair;
+      }
+      last = pair;
+    }
+  }
+
+  return fluid_defpreset_index_keys(preset);
+}
+
+/*
+ * fluid_defpreset_index_keys
+ *
+ * Sorts the zone pairs by key: for every key the pairs whose key
+ * range covers it are stored next to each other, in note-on order.
+ */
+int
+fluid_defpreset_index_keys(fluid_defpreset_t* preset)
+{
+  fluid_zone_pair_t* pair;
+  int fill[128];
+  int lo, hi;
+  int k;
+
+  FLUID_MEMSET(preset->key_first, 0, sizeof(preset->key_first));
+  for (pair = preset->pair; pair != NULL; pair = pair->next) {
+    lo = (pair->keylo < 0) ? 0 : pair->keylo;
+    hi = (pair->keyhi > 127) ? 127 : pair->keyhi;
+    for (k = lo; k <= hi; k++) {
+      preset->key_first[k + 1]++;
+    }
+  }
+  for (k = 0; k < 128; k++) {
+    preset->key_first[k + 1] += preset->key_first[k];
+    fill[k] = preset->key_first[k];
+  }
+
+  preset->key_pair = FLUID_ARRAY(fluid_zone_pair_t*, preset->key_first[128] + 1);
+  if (preset->key_pair == NULL) {
+    FLUID_LOG(FLUID_ERR, "Out of memory");
+    return FLUID_FAILED;
+  }
+
+  for (pair = preset->pair; pair != NULL; pair = pair->next) {
+    lo = (pair->keylo < 0) ? 0 : pair->keylo;
+    hi = (pair->keyhi > 127) ? 127 : pair->keyhi;
+    for (k = lo; k <= hi; k++) {
+      preset->key_pair[fill[k]++] = pair;
+    }
+  }
   return FLUID_OK;
 }
 
@@ -1695,6 +1769,324 @@ fluid_inst_zone_inside_range(fluid_inst_zone_t* zone, int key, int vel)
 	  (zone->velhi >= vel));
 }
 
+/***************************************************************
+ *
+ *                           ZONE PAIR
+ */
+
+/*
+ * fluid_zone_pair_collect_mods
+ *
+ * Puts the modulators of a global and a local zone into one list.
+ * Identical modulators in the global zone are replaced by the local
+ * ones (SF 2.01 section 9.5.1 page 69, 'bullet' 3 defines
+ * 'identical').  Returns the number of entries in the list, some of
+ * which may be NULL.
+ */
+static int
+fluid_zone_pair_collect_mods(fluid_mod_t* global_mod, fluid_mod_t* local_mod,
+			     fluid_mod_t** mod_list)
+{
+  fluid_mod_t* mod;
+  int mod_list_count = 0;
+  int i;
+
+  for (mod = global_mod; (mod != NULL) && (mod_list_count < FLUID_NUM_MOD); mod = mod->next) {
+    mod_list[mod_list_count++] = mod;
+  }
+
+  for (mod = local_mod; (mod != NULL) && (mod_list_count < FLUID_NUM_MOD); mod = mod->next) {
+    for (i = 0; i < mod_list_count; i++) {
+      if (mod_list[i] && fluid_mod_test_identity(mod, mod_list[i])) {
+	mod_list[i] = NULL;
+      }
+    }
+    mod_list[mod_list_count++] = mod;
+  }
+
+  return mod_list_count;
+}
+
+/*
+ * new_fluid_zone_pair
+ */
+fluid_zone_pair_t*
+new_fluid_zone_pair(fluid_preset_zone_t* global_preset_zone,
+		    fluid_preset_zone_t* preset_zone,
+		    fluid_inst_zone_t* global_inst_zone,
+		    fluid_inst_zone_t* inst_zone)
+{
+  fluid_zone_pair_t* pair;
+  fluid_mod_t* inst_mods[FLUID_NUM_MOD];
+  fluid_mod_t* preset_mods[FLUID_NUM_MOD];
+  int inst_count, preset_count;
+  unsigned char gen_id[GEN_LAST];
+  float gen_val[GEN_LAST];
+  fluid_gen_t gen_default[GEN_LAST];
+  int gen_count = 0;
+  int set;
+  double val;
+  int i, n;
+
+  pair = FLUID_NEW(fluid_zone_pair_t);
+  if (pair == NULL) {
+    FLUID_LOG(FLUID_ERR, "Out of memory");
+    return NULL;
+  }
+  FLUID_MEMSET(pair, 0, sizeof(fluid_zone_pair_t));
+  pair->sample = fluid_inst_zone_get_sample(inst_zone);
+  pair->keylo = (preset_zone->keylo > inst_zone->keylo) ? preset_zone->keylo : inst_zone->keylo;
+  pair->keyhi = (preset_zone->keyhi < inst_zone->keyhi) ? preset_zone->keyhi : inst_zone->keyhi;
+  pair->vello = (preset_zone->vello > inst_zone->vello) ? preset_zone->vello : inst_zone->vello;
+  pair->velhi = (preset_zone->velhi < inst_zone->velhi) ? preset_zone->velhi : inst_zone->velhi;
+
+  fluid_gen_set_default_values(&gen_default[0]);
+  for (i = 0; i < GEN_LAST; i++) {
+
+    /* SF 2.01 section 9.4 'bullet' 4: A generator in a local
+     * instrument zone supersedes a global instrument zone
+     * generator.  Both cases supersede the default generator. */
+    set = 1;
+    if (inst_zone->gen[i].flags) {
+      val = (float) inst_zone->gen[i].val;
+    } else if ((global_inst_zone != NULL) && global_inst_zone->gen[i].flags) {
+      val = (float) global_inst_zone->gen[i].val;
+    } else {
+      val = gen_default[i].val;
+      set = 0;
+    }
+
+    /* SF 2.01 section 8.5 page 58: If some generators are
+     * encountered at preset level, they should be ignored */
+    if ((i != GEN_STARTADDROFS)
+	&& (i != GEN_ENDADDROFS)
+	&& (i != GEN_STARTLOOPADDROFS)
+	&& (i != GEN_ENDLOOPADDROFS)
+	&& (i != GEN_STARTADDRCOARSEOFS)
+	&& (i != GEN_ENDADDRCOARSEOFS)
+	&& (i != GEN_STARTLOOPADDRCOARSEOFS)
+	&& (i != GEN_KEYNUM)
+	&& (i != GEN_VELOCITY)
+	&& (i != GEN_ENDLOOPADDRCOARSEOFS)
+	&& (i != GEN_SAMPLEMODE)
+	&& (i != GEN_EXCLUSIVECLASS)
+	&& (i != GEN_OVERRIDEROOTKEY)) {
+
+      /* SF 2.01 section 9.4 'bullet' 9: A generator in a local
+       * preset zone supersedes a global preset zone generator.  The
+       * effect is -added- to the destination summing node. */
+      if (preset_zone->gen[i].flags) {
+	val += (float) preset_zone->gen[i].val;
+	set = 1;
+      } else if ((global_preset_zone != NULL) && global_preset_zone->gen[i].flags) {
+	val += (float) global_preset_zone->gen[i].val;
+	set = 1;
+      }
+    }
+
+    if (set) {
+      gen_id[gen_count] = (unsigned char) i;
+      gen_val[gen_count] = (float) val;
+      gen_count++;
+    }
+  }
+
+  /* Instrument modulators, disabled ones CANNOT be skipped. */
+  n = fluid_zone_pair_collect_mods(global_inst_zone ? global_inst_zone->mod : NULL,
+				   inst_zone->mod, inst_mods);
+  inst_count = 0;
+  for (i = 0; i < n; i++) {
+    if (inst_mods[i] != NULL) {
+      inst_mods[inst_count++] = inst_mods[i];
+    }
+  }
+
+  /* Preset modulators (SF 2.01 page 69, second-last bullet),
+   * disabled ones can be skipped. */
+  n = fluid_zone_pair_collect_mods(global_preset_zone ? global_preset_zone->mod : NULL,
+				   preset_zone->mod, preset_mods);
+  preset_count = 0;
+  for (i = 0; i < n; i++) {
+    if ((preset_mods[i] != NULL) && (preset_mods[i]->amount != 0)) {
+      preset_mods[preset_count++] = preset_mods[i];
+    }
+  }
+
+  pair->gen_id = FLUID_ARRAY(unsigned char, gen_count + 1);
+  pair->gen_val = FLUID_ARRAY(float, gen_count + 1);
+  pair->mod = FLUID_ARRAY(fluid_mod_t*, inst_count + preset_count + 1);
+  if ((pair->gen_id == NULL) || (pair->gen_val == NULL) || (pair->mod == NULL)) {
+    FLUID_LOG(FLUID_ERR, "Out of memory");
+    delete_fluid_zone_pair(pair);
+    return NULL;
+  }
+
+  pair->gen_count = gen_count;
+  FLUID_MEMCPY(pair->gen_id, gen_id, gen_count * sizeof(unsigned char));
+  FLUID_MEMCPY(pair->gen_val, gen_val, gen_count * sizeof(float));
+  pair->inst_mod_count = inst_count;
+  pair->preset_mod_count = preset_count;
+  FLUID_MEMCPY(pair->mod, inst_mods, inst_count * sizeof(fluid_mod_t*));
+  FLUID_MEMCPY(pair->mod + inst_count, preset_mods, preset_count * sizeof(fluid_mod_t*));
+
+  return pair;
+}
+
+/*
+ * delete_fluid_zone_pair
+ */
+int
+delete_fluid_zone_pair(fluid_zone_pair_t* pair)
+{
+  if (pair->gen_id) FLUID_FREE(pair->gen_id);
+  if (pair->gen_val) FLUID_FREE(pair->gen_val);
+  if (pair->mod) FLUID_FREE(pair->mod);
+  FLUID_FREE(pair);
+  return FLUID_OK;
+}
+
+/*
+ * fluid_zone_pair_link_stereo
+ *
+ * Checks whether next, which follows pair in note-on order, is the
+ * other half of a stereo sample with the same settings but for the
+ * pan. If so, pair takes it over: the voice it starts plays both
+ * samples, and next isn't needed any more. The SoundFont's sample
+ * links aren't kept, so left and right samples that lie in the same
+ * data with the same length, loop and pitch are taken for a pair.
+ */
+int
+fluid_zone_pair_link_stereo(fluid_zone_pair_t* pair, fluid_zone_pair_t* next)
+{
+  fluid_sample_t* a = pair->sample;
+  fluid_sample_t* b = next->sample;
+  int side_a = a->sampletype & (FLUID_SAMPLETYPE_LEFT | FLUID_SAMPLETYPE_RIGHT);
+  int side_b = b->sampletype & (FLUID_SAMPLETYPE_LEFT | FLUID_SAMPLETYPE_RIGHT);
+  int mod_count;
+  int pan = -1;
+  float pan_a, pan_b;
+  int i;
+
+  if ((pair->link_sample != NULL)
+      || !(((side_a == FLUID_SAMPLETYPE_LEFT) && (side_b == FLUID_SAMPLETYPE_RIGHT))
+	   || ((side_a == FLUID_SAMPLETYPE_RIGHT) && (side_b == FLUID_SAMPLETYPE_LEFT)))) {
+    return 0;
+  }
+
+  if (!a->valid || !b->valid
+      || (a->data != b->data)
+      || (a->end - a->start != b->end - b->start)
+      || (a->loopstart - a->start != b->loopstart - b->start)
+      || (a->loopend - a->start != b->loopend - b->start)
+      || (a->samplerate != b->samplerate)
+      || (a->origpitch != b->origpitch)
+      || (a->pitchadj != b->pitchadj)) {
+    return 0;
+  }
+
+  if ((pair->keylo != next->keylo) || (pair->keyhi != next->keyhi)
+      || (pair->vello != next->vello) || (pair->velhi != next->velhi)
+      || (pair->gen_count != next->gen_count)
+      || (pair->inst_mod_count != next->inst_mod_count)
+      || (pair->preset_mod_count != next->preset_mod_count)) {
+    return 0;
+  }
+
+  for (i = 0; i < pair->gen_count; i++) {
+    if (pair->gen_id[i] != next->gen_id[i]) {
+      return 0;
+    }
+    if (pair->gen_id[i] == GEN_PAN) {
+      pan = i;
+    } else if (pair->gen_val[i] != next->gen_val[i]) {
+      return 0;
+    }
+  }
+
+  mod_count = pair->inst_mod_count + pair->preset_mod_count;
+  for (i = 0; i < mod_count; i++) {
+    if (!fluid_mod_test_identity(pair->mod[i], next->mod[i])
+	|| (pair->mod[i]->amount != next->mod[i]->amount)) {
+      return 0;
+    }
+  }
+
+  pan_a = (pan >= 0) ? pair->gen_val[pan] : 0.0f;
+  pan_b = (pan >= 0) ? next->gen_val[pan] : 0.0f;
+
+  /* The voice steps through the sample that comes first in the data */
+  if (b->start < a->start) {
+    pair->sample = b;
+    pair->link_sample = a;
+    pair->link_pan = pan_a;
+    if (pan >= 0) {
+      pair->gen_val[pan] = pan_b;
+    }
+  } else {
+    pair->link_sample = b;
+    pair->link_pan = pan_b;
+  }
+  return 1;
+}
+
+/*
+ * fluid_zone_pair_noteon
+ *
+ * Starts one voice for a zone pair that the note falls into.
+ */
+int
+fluid_zone_pair_noteon(fluid_zone_pair_t* pair, fluid_synth_t* synth, int chan, int key, int vel)
+{
+  fluid_voice_t* voice;
+  int mod_count;
+  int i;
+
+  /* allocate a new synthesis process and initialize it */
+  voice = fluid_synth_alloc_voice(synth, pair->sample, chan, key, vel);
+  if (voice == NULL) {
+    return FLUID_FAILED;
+  }
+
+  /* Generators: the instrument and preset levels have already been
+   * merged, see new_fluid_zone_pair. */
+  for (i = 0; i < pair->gen_count; i++) {
+    fluid_voice_gen_set(voice, pair->gen_id[i], pair->gen_val[i]);
+  }
+
+  /* Instrument modulators -supersede- existing (default)
+   * modulators.  SF 2.01 page 69, 'bullet' 6 */
+  for (i = 0; i < pair->inst_mod_count; i++) {
+    fluid_voice_add_mod(voice, pair->mod[i], FLUID_VOICE_OVERWRITE);
+  }
+
+  /* Preset modulators -add- to existing instrument / default
+   * modulators.  SF2.01 page 70 first bullet on page */
+  mod_count = pair->inst_mod_count + pair->preset_mod_count;
+  for (; i < mod_count; i++) {
+    fluid_voice_add_mod(voice, pair->mod[i], FLUID_VOICE_ADD);
+  }
+
+  if (pair->link_sample != NULL) {
+    fluid_voice_set_link(voice, pair->link_sample, pair->link_pan);
+  }
+
+  /* add the synthesis process to the synthesis loop. */
+  fluid_synth_start_voice(synth, voice);
+  return FLUID_OK;
+}
+
+/*
+ * fluid_zone_pair_inside_range
+ */
+int
+fluid_zone_pair_inside_range(fluid_zone_pair_t* pair, int key, int vel)
+{
+  return ((pair->keylo <= key) &&
+	  (pair->keyhi >= key) &&
+	  (pair->vello <= vel) &&
+	  (pair->velhi >= vel));
+}
+
 /***************************************************************
  *
  *                           SAMPLE
@@ -1908,7 +2300,6 @@ char idlist[] = {
     "ICOPICMTISFTsnamsmplphdrpbagpmodpgeninstibagimodigenshdr"
 };
 
-static unsigned int sdtachunk_size;
 
 /* sound font file load functions */
 static int
@@ -2168,8 +2559,7 @@ process_sdta (int size, SFData * sf, FILE * fd)
   /* sample data follows */
   sf->samplepos = (int) ftell (fd);
 
-  /* used in fixup_sample() to check validity of sample headers */
-  sdtachunk_size = chunk.size;
+  /* also used in fixup_sample() to check validity of sample headers */
   sf->samplesize = chunk.size;
 
   FSKIP (chunk.size, fd);
@@ -3098,7 +3488,7 @@ fixup_sample (SFData * sf)
       /* if sample is not a ROM sample and end is over the sample data chunk
          or sam start is greater than 4 less than the end (at least 4 samples) */
       if ((!(sam->sampletype & FLUID_SAMPLETYPE_ROM)
-	  && sam->end > sdtachunk_size) || sam->start > (sam->end - 4))
+	  && sam->end > sf->samplesize) || sam->start > (sam->end - 4))
 	{
 	  FLUID_LOG (FLUID_WARN, _("Sample '%s' start/end file positions are invalid,"
 	      " disabling and will not be saved"), sam->name);
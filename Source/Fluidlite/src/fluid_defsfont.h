@@ -448,6 +448,7 @@ typedef struct _fluid_defpreset_t fluid_defpreset_t;
 typedef struct _fluid_preset_zone_t fluid_preset_zone_t;
 typedef struct _fluid_inst_t fluid_inst_t;
 typedef struct _fluid_inst_zone_t fluid_inst_zone_t;
+typedef struct _fluid_zone_pair_t fluid_zone_pair_t;
 
 /*
 
@@ -485,6 +486,10 @@ struct _fluid_defsfont_t
   short* sampledata;        /* the sample data, loaded in ram */
   fluid_list_t* sample;      /* the samples in this soundfont */
   fluid_defpreset_t* preset; /* the presets of this soundfont */
+  int preset_count;                  /* the number of presets */
+  fluid_defpreset_t** preset_table;  /* the presets by index, in list order */
+  int* preset_hash;                  /* (bank, num) -> index, -1 for empty slots */
+  int preset_hash_bits;              /* the hash table has 1 << bits slots */
 
   fluid_preset_t iter_preset;        /* preset interface used in the iteration */
   fluid_defpreset_t* iter_cur;       /* the current preset in the iteration */
@@ -496,6 +501,8 @@ int delete_fluid_defsfont(fluid_defsfont_t* sfont);
 int fluid_defsfont_load(fluid_defsfont_t* sfont, const char* file);
 char* fluid_defsfont_get_name(fluid_defsfont_t* sfont);
 fluid_defpreset_t* fluid_defsfont_get_preset(fluid_defsfont_t* sfont, unsigned int bank, unsigned int prenum);
+int fluid_defsfont_find_preset(fluid_defsfont_t* sfont, unsigned int bank, unsigned int prenum);
+int fluid_defsfont_index_presets(fluid_defsfont_t* sfont);
 void fluid_defsfont_iteration_start(fluid_defsfont_t* sfont);
 int fluid_defsfont_iteration_next(fluid_defsfont_t* sfont, fluid_preset_t* preset);
 int fluid_defsfont_load_sampledata(fluid_defsfont_t* sfont);
@@ -516,6 +523,9 @@ struct _fluid_defpreset_t
   unsigned int num;                     /* the preset number */
   fluid_preset_zone_t* global_zone;        /* the global zone of the preset */
   fluid_preset_zone_t* zone;               /* the chained list of preset zones */
+  fluid_zone_pair_t* pair;                 /* the compiled zone pairs, in note-on order */
+  int key_first[129];                      /* the pairs covering key k are ... */
+  fluid_zone_pair_t** key_pair;            /* ... key_pair[key_first[k] .. key_first[k+1]-1] */
 };
 
 fluid_defpreset_t* new_fluid_defpreset(fluid_defsfont_t* sfont);
@@ -530,6 +540,8 @@ int fluid_defpreset_get_banknum(fluid_defpreset_t* preset);
 int fluid_defpreset_get_num(fluid_defpreset_t* preset);
 char* fluid_defpreset_get_name(fluid_defpreset_t* preset);
 int fluid_defpreset_noteon(fluid_defpreset_t* preset, fluid_synth_t* synth, int chan, int key, int vel);
+int fluid_defpreset_compile(fluid_defpreset_t* preset);
+int fluid_defpreset_index_keys(fluid_defpreset_t* preset);
 
 /*
  * fluid_preset_zone
@@ -595,6 +607,42 @@ int fluid_inst_zone_import_sfont(fluid_inst_zone_t* zone, SFZone *sfzone, fluid_
 int fluid_inst_zone_inside_range(fluid_inst_zone_t* zone, int key, int vel);
 fluid_sample_t* fluid_inst_zone_get_sample(fluid_inst_zone_t* zone);
 
+/*
+ * fluid_zone_pair_t
+ *
+ * One preset zone combined with one instrument zone at load time.
+ * The key and velocity ranges are the intersection of both zones,
+ * the generators are already merged as SF 2.01 section 9.4 asks
+ * (instrument values set, preset values added) and the modulator
+ * lists have their identical entries removed.
+ */
+struct _fluid_zone_pair_t
+{
+  fluid_zone_pair_t* next;
+  fluid_sample_t* sample;
+  fluid_sample_t* link_sample; /* the other half of a stereo sample, or NULL */
+  float link_pan;           /* the pan of link_sample's zone */
+  int keylo;
+  int keyhi;
+  int vello;
+  int velhi;
+  int gen_count;            /* number of generators set by the zones */
+  unsigned char* gen_id;    /* their numbers ... */
+  float* gen_val;           /* ... and their merged values */
+  int inst_mod_count;       /* number of instrument modulators */
+  int preset_mod_count;     /* number of preset modulators */
+  fluid_mod_t** mod;        /* instrument modulators followed by preset modulators */
+};
+
+fluid_zone_pair_t* new_fluid_zone_pair(fluid_preset_zone_t* global_preset_zone,
+				       fluid_preset_zone_t* preset_zone,
+				       fluid_inst_zone_t* global_inst_zone,
+				       fluid_inst_zone_t* inst_zone);
+int delete_fluid_zone_pair(fluid_zone_pair_t* pair);
+int fluid_zone_pair_inside_range(fluid_zone_pair_t* pair, int key, int vel);
+int fluid_zone_pair_link_stereo(fluid_zone_pair_t* pair, fluid_zone_pair_t* next);
+int fluid_zone_pair_noteon(fluid_zone_pair_t* pair, fluid_synth_t* synth, int chan, int key, int vel);
+
 
 
 fluid_sample_t* new_fluid_sample(void);
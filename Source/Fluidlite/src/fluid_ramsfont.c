@@ -53,6 +53,9 @@ fluid_ramsfont_create_sfont()
   }
 
   sfont->data = ramsfont;
+  sfont->refcount = 0;
+  sfont->presets = NULL;
+  sfont->preset_count = 0;
   sfont->free = fluid_ramsfont_sfont_delete;
   sfont->get_name = fluid_ramsfont_sfont_get_name;
   sfont->get_preset = fluid_ramsfont_sfont_get_preset;
@@ -56,11 +56,17 @@
   { if ((_preset) && (_preset)->notify) { (*(_preset)->notify)(_preset,_reason,_chan); }}
 
 
-#define fluid_sample_incr_ref(_sample) { (_sample)->refcount++; }
+/* Voices may be turned off on several threads at once (see the
+   "synth.cpu-cores" setting), and samples may be shared by several
+   synthesizers (see fluid_synth_share_sfont()), so these counts are
+   updated atomically */
+#define fluid_sfont_incr_ref(_sf) { fluid_atomic_int_inc(&(_sf)->refcount); }
+#define fluid_sfont_decr_ref(_sf) { fluid_atomic_int_dec(&(_sf)->refcount); }
+
+#define fluid_sample_incr_ref(_sample) { fluid_atomic_int_inc(&(_sample)->refcount); }
 
 #define fluid_sample_decr_ref(_sample) \
-  (_sample)->refcount--; \
-  if (((_sample)->refcount == 0) && ((_sample)->notify)) \
+  if (fluid_atomic_int_dec_and_test(&(_sample)->refcount) && ((_sample)->notify)) \
     (*(_sample)->notify)(_sample, FLUID_SAMPLE_DONE);
 
 
@@ -22,6 +22,7 @@
 
 #include "fluid_synth.h"
 #include "fluid_sys.h"
+#include "fluid_conv.h"
 #include "fluid_chan.h"
 #include "fluid_tuning.h"
 #include "fluid_settings.h"
@@ -65,6 +66,23 @@ static int fluid_synth_sysex_midi_tuning (fluid_synth_t *synth, const char *data
                                           int *response_len, int avail_response,
                                           int *handled, int dryrun);
 
+static int fluid_synth_start_workers(fluid_synth_t* synth);
+static void fluid_synth_stop_workers(fluid_synth_t* synth);
+static void fluid_synth_worker(void* data);
+static void fluid_synth_one_block_dry(fluid_synth_t* synth);
+static void fluid_synth_reset_voice_lists(fluid_synth_t* synth);
+static void fluid_synth_update_voice_lists(fluid_synth_t* synth);
+static void fluid_synth_link_key_voice(fluid_synth_t* synth, fluid_voice_t* voice);
+static void fluid_synth_unlink_key_voice(fluid_voice_t* voice);
+static void fluid_synth_build_steal_heap(fluid_synth_t* synth);
+static void fluid_synth_push_steal_heap(fluid_synth_t* synth, fluid_voice_t* voice);
+static fluid_voice_t* fluid_synth_pop_steal_heap(fluid_synth_t* synth);
+static void fluid_synth_update_steal_heap(fluid_synth_t* synth, fluid_voice_t* voice);
+static void fluid_synth_render_voices_parallel(fluid_synth_t* synth,
+                                               fluid_real_t* reverb_buf,
+                                               fluid_real_t* chorus_buf);
+static int fluid_synth_event_offset(fluid_synth_t* synth);
+
 /* default modulators
  * SF2.01 page 52 ff:
  *
@@ -128,6 +146,9 @@ void fluid_synth_settings(fluid_settings_t* settings)
 			     44100.0f, 22050.0f, 96000.0f,
 			     0, NULL, NULL);
   fluid_settings_register_int(settings, "synth.min-note-length", 10, 0, 65535, 0, NULL, NULL);
+  fluid_settings_register_int(settings, "synth.cpu-cores", 1, 1, 256, 0, NULL, NULL);
+  fluid_settings_register_int(settings, "synth.coalesce-controllers", 0, 0, 1, 0, NULL, NULL);
+  fluid_settings_register_int(settings, "synth.event-offset", 0, -1, 65535, 0, NULL, NULL);
 }
 
 /*
@@ -371,6 +392,9 @@ new_fluid_synth(fluid_settings_t *settings)
   fluid_settings_getnum(settings, "synth.gain", &synth->gain);
   fluid_settings_getint(settings, "synth.min-note-length", &i);
   synth->min_note_length_ticks = (unsigned int) (i*synth->sample_rate/1000.0f);
+  fluid_settings_getint(settings, "synth.cpu-cores", &synth->cpu_cores);
+  fluid_settings_getint(settings, "synth.coalesce-controllers", &synth->coalesce_controllers);
+  fluid_settings_getint(settings, "synth.event-offset", &synth->event_offset);
 
 
   /* register the callbacks */
@@ -418,6 +442,12 @@ new_fluid_synth(fluid_settings_t *settings)
     synth->effects_channels = 2;
   }
 
+  if (synth->cpu_cores < 1) {
+    FLUID_LOG(FLUID_WARN, "Requested number of CPU cores is smaller than 1. "
+	     "Changing this setting to 1.");
+    synth->cpu_cores = 1;
+  }
+
 
   /* The number of buffers is determined by the higher number of nr
    * groups / nr audio channels.  If LADSPA is unused, they should be
@@ -435,6 +465,8 @@ new_fluid_synth(fluid_settings_t *settings)
   /* as soon as the synth is created it starts playing. */
   synth->state = FLUID_SYNTH_PLAYING;
   synth->sfont = NULL;
+  synth->sfont_spare = new_fluid_list();
+  synth->storesfont = NULL;
   synth->noteid = 0;
   synth->ticks = 0;
   synth->tuning = NULL;
@@ -464,19 +496,37 @@ new_fluid_synth(fluid_settings_t *settings)
   /* allocate all synthesis processes */
   synth->nvoice = synth->polyphony;
   synth->voice = FLUID_ARRAY(fluid_voice_t*, synth->nvoice);
-  if (synth->voice == NULL) {
+  synth->voice_dsp = FLUID_ARRAY(fluid_voice_dsp_t, synth->nvoice);
+  if ((synth->voice == NULL) || (synth->voice_dsp == NULL)) {
     goto error_recovery;
   }
   for (i = 0; i < synth->nvoice; i++) {
-    synth->voice[i] = new_fluid_voice(synth->sample_rate);
+    synth->voice[i] = new_fluid_voice(synth->sample_rate, &synth->voice_dsp[i]);
     if (synth->voice[i] == NULL) {
       goto error_recovery;
     }
   }
 
+  synth->active_voice = FLUID_ARRAY(fluid_voice_t*, synth->nvoice);
+  synth->free_voice = FLUID_ARRAY(fluid_voice_t*, synth->nvoice);
+  synth->key_voices = FLUID_ARRAY(fluid_voice_t*, 128 * synth->midi_channels);
+  synth->steal_heap = FLUID_ARRAY(fluid_voice_t*, synth->nvoice);
+  synth->pending_mods = FLUID_ARRAY(unsigned int, FLUID_PENDING_MODS_WORDS * synth->midi_channels);
+  if ((synth->active_voice == NULL) || (synth->free_voice == NULL)
+      || (synth->key_voices == NULL) || (synth->steal_heap == NULL)
+      || (synth->pending_mods == NULL)) {
+    FLUID_LOG(FLUID_ERR, "Out of memory");
+    goto error_recovery;
+  }
+  FLUID_MEMSET(synth->pending_mods, 0,
+	       FLUID_PENDING_MODS_WORDS * synth->midi_channels * sizeof(unsigned int));
+  fluid_synth_reset_voice_lists(synth);
+
   /* Allocate the sample buffers */
   synth->left_buf = NULL;
   synth->right_buf = NULL;
+  synth->left_stage = NULL;
+  synth->right_stage = NULL;
   synth->fx_left_buf = NULL;
   synth->fx_right_buf = NULL;
 
@@ -504,6 +554,17 @@ new_fluid_synth(fluid_settings_t *settings)
     }
   }
 
+  synth->left_stage = FLUID_ARRAY(fluid_real_t*, synth->nbuf);
+  synth->right_stage = FLUID_ARRAY(fluid_real_t*, synth->nbuf);
+
+  if ((synth->left_stage == NULL) || (synth->right_stage == NULL)) {
+    FLUID_LOG(FLUID_ERR, "Out of memory");
+    goto error_recovery;
+  }
+
+  FLUID_MEMCPY(synth->left_stage, synth->left_buf, synth->nbuf * sizeof(fluid_real_t*));
+  FLUID_MEMCPY(synth->right_stage, synth->right_buf, synth->nbuf * sizeof(fluid_real_t*));
+
   /* Effects audio buffers */
 
   synth->fx_left_buf = FLUID_ARRAY(fluid_real_t*, synth->effects_channels);
@@ -528,6 +589,14 @@ new_fluid_synth(fluid_settings_t *settings)
   }
 
 
+  /* Voice rendering threads */
+
+  if (synth->cpu_cores > 1) {
+    if (fluid_synth_start_workers(synth) != FLUID_OK) {
+      goto error_recovery;
+    }
+  }
+
   synth->cur = FLUID_BUFSIZE;
   synth->dither_index = 0;
 
@@ -573,10 +642,17 @@ void
 fluid_synth_set_sample_rate(fluid_synth_t* synth, float sample_rate)
 {
     int i;
+    synth->sample_rate = sample_rate;
+
     for (i = 0; i < synth->nvoice; i++) {
+      /* release the voice's sample and soundfont before dropping it */
+      if (_PLAYING(synth->voice[i])) {
+        fluid_voice_off(synth->voice[i]);
+      }
       delete_fluid_voice(synth->voice[i]);
-      synth->voice[i] = new_fluid_voice(synth->sample_rate);
+      synth->voice[i] = new_fluid_voice(synth->sample_rate, &synth->voice_dsp[i]);
     }
+    fluid_synth_reset_voice_lists(synth);
 
     delete_fluid_chorus(synth->chorus);
     synth->chorus = new_fluid_chorus(synth->sample_rate);
@@ -598,6 +674,9 @@ delete_fluid_synth(fluid_synth_t* synth)
     return FLUID_OK;
   }
 
+  /* the workers use the voices, so they go first */
+  fluid_synth_stop_workers(synth);
+
   synth->state = FLUID_SYNTH_STOPPED;
 
   /* turn off all voices, needed to unload SoundFont data */
@@ -608,6 +687,15 @@ delete_fluid_synth(fluid_synth_t* synth)
     }
   }
 
+  /* the channels may hold preset handles owned by the SoundFonts */
+  if (synth->channel != NULL) {
+    for (i = 0; i < synth->midi_channels; i++) {
+      if (synth->channel[i] != NULL) {
+	fluid_channel_set_preset(synth->channel[i], NULL);
+      }
+    }
+  }
+
   /* delete all the SoundFonts */
   for (list = synth->sfont; list; list = fluid_list_next(list)) {
     sfont = (fluid_sfont_t*) fluid_list_get(list);
@@ -615,6 +703,7 @@ delete_fluid_synth(fluid_synth_t* synth)
   }
 
   delete_fluid_list(synth->sfont);
+  delete1_fluid_list(synth->sfont_spare);
 
   /* and the SoundFont offsets */
   for (list = synth->bank_offsets; list; list = fluid_list_next(list)) {
@@ -653,6 +742,30 @@ delete_fluid_synth(fluid_synth_t* synth)
     FLUID_FREE(synth->voice);
   }
 
+  if (synth->voice_dsp != NULL) {
+    FLUID_FREE(synth->voice_dsp);
+  }
+
+  if (synth->active_voice != NULL) {
+    FLUID_FREE(synth->active_voice);
+  }
+
+  if (synth->free_voice != NULL) {
+    FLUID_FREE(synth->free_voice);
+  }
+
+  if (synth->key_voices != NULL) {
+    FLUID_FREE(synth->key_voices);
+  }
+
+  if (synth->pending_mods != NULL) {
+    FLUID_FREE(synth->pending_mods);
+  }
+
+  if (synth->steal_heap != NULL) {
+    FLUID_FREE(synth->steal_heap);
+  }
+
   /* free all the sample buffers */
   if (synth->left_buf != NULL) {
     for (i = 0; i < synth->nbuf; i++) {
@@ -672,6 +785,14 @@ delete_fluid_synth(fluid_synth_t* synth)
     FLUID_FREE(synth->right_buf);
   }
 
+  if (synth->left_stage != NULL) {
+    FLUID_FREE(synth->left_stage);
+  }
+
+  if (synth->right_stage != NULL) {
+    FLUID_FREE(synth->right_stage);
+  }
+
   if (synth->fx_left_buf != NULL) {
     for (i = 0; i < 2; i++) {
       if (synth->fx_left_buf[i] != NULL) {
@@ -786,20 +907,22 @@ fluid_synth_noteon(fluid_synth_t* synth, int chan, int key, int vel)
 int
 fluid_synth_noteoff(fluid_synth_t* synth, int chan, int key)
 {
-  int i;
   fluid_voice_t* voice;
   int status = FLUID_FAILED;
 /*   fluid_mutex_lock(synth->busy); /\* Don't interfere with the audio thread *\/ */
 /*   fluid_mutex_unlock(synth->busy); */
 
-  for (i = 0; i < synth->polyphony; i++) {
-    voice = synth->voice[i];
+  if ((chan < 0) || (chan >= synth->midi_channels)) {
+    return FLUID_FAILED;
+  }
+
+  for (voice = synth->key_voices[128 * chan + (key & 0x7f)]; voice; voice = voice->key_next) {
     if (_ON(voice) && (voice->chan == chan) && (voice->key == key)) {
       if (synth->verbose) {
 	int used_voices = 0;
 	int k;
-	for (k = 0; k < synth->polyphony; k++) {
-	  if (!_AVAILABLE(synth->voice[k])) {
+	for (k = 0; k < synth->nactive; k++) {
+	  if (!_AVAILABLE(synth->active_voice[k])) {
 	    used_voices++;
 	  }
 	}
@@ -809,10 +932,11 @@ fluid_synth_noteoff(fluid_synth_t* synth, int chan, int key)
 		 (float) voice->ticks / 44100.0f,
 		 used_voices);
       } /* if verbose */
-      fluid_voice_noteoff(voice);
+      fluid_voice_noteoff_at(voice, fluid_synth_event_offset(synth));
+      fluid_synth_update_steal_heap(synth, voice);
       status = FLUID_OK;
     } /* if voice on */
-  } /* for all voices */
+  } /* for all voices on this key */
   return status;
 }
 
@@ -828,11 +952,12 @@ fluid_synth_damp_voices(fluid_synth_t* synth, int chan)
 /*   fluid_mutex_lock(synth->busy); /\* Don't interfere with the audio thread *\/ */
 /*   fluid_mutex_unlock(synth->busy); */
 
-  for (i = 0; i < synth->polyphony; i++) {
-    voice = synth->voice[i];
+  for (i = 0; i < synth->nactive; i++) {
+    voice = synth->active_voice[i];
     if ((voice->chan == chan) && _SUSTAINED(voice)) {
 /*        printf("turned off sustained note: chan=%d, key=%d, vel=%d\n", voice->chan, voice->key, voice->vel); */
-      fluid_voice_noteoff(voice);
+      fluid_voice_noteoff_at(voice, fluid_synth_event_offset(synth));
+      fluid_synth_update_steal_heap(synth, voice);
     }
   }
 
@@ -1178,10 +1303,11 @@ fluid_synth_all_notes_off(fluid_synth_t* synth, int chan)
   int i;
   fluid_voice_t* voice;
 
-  for (i = 0; i < synth->polyphony; i++) {
-    voice = synth->voice[i];
+  for (i = 0; i < synth->nactive; i++) {
+    voice = synth->active_voice[i];
     if (_PLAYING(voice) && (voice->chan == chan)) {
-      fluid_voice_noteoff(voice);
+      fluid_voice_noteoff_at(voice, fluid_synth_event_offset(synth));
+      fluid_synth_update_steal_heap(synth, voice);
     }
   }
   return FLUID_OK;
@@ -1198,10 +1324,10 @@ fluid_synth_all_sounds_off(fluid_synth_t* synth, int chan)
   int i;
   fluid_voice_t* voice;
 
-  for (i = 0; i < synth->polyphony; i++) {
-    voice = synth->voice[i];
+  for (i = 0; i < synth->nactive; i++) {
+    voice = synth->active_voice[i];
     if (_PLAYING(voice) && (voice->chan == chan)) {
-      fluid_voice_off(voice);
+      fluid_voice_stop_at(voice, fluid_synth_event_offset(synth));
     }
   }
   return FLUID_OK;
@@ -1219,8 +1345,8 @@ fluid_synth_system_reset(fluid_synth_t* synth)
   int i;
   fluid_voice_t* voice;
 
-  for (i = 0; i < synth->polyphony; i++) {
-    voice = synth->voice[i];
+  for (i = 0; i < synth->nactive; i++) {
+    voice = synth->active_voice[i];
     if (_PLAYING(voice)) {
       fluid_voice_off(voice);
     }
@@ -1236,6 +1362,23 @@ fluid_synth_system_reset(fluid_synth_t* synth)
   return FLUID_OK;
 }
 
+/*
+ * fluid_synth_modulate_channel_voices
+ */
+static void
+fluid_synth_modulate_channel_voices(fluid_synth_t* synth, int chan, int is_cc, int ctrl)
+{
+  int i;
+  fluid_voice_t* voice;
+
+  for (i = 0; i < synth->nactive; i++) {
+    voice = synth->active_voice[i];
+    if (voice->chan == chan) {
+      fluid_voice_modulate(voice, is_cc, ctrl);
+    }
+  }
+}
+
 /*
  * fluid_synth_modulate_voices
  *
@@ -1245,18 +1388,20 @@ fluid_synth_system_reset(fluid_synth_t* synth)
 int
 fluid_synth_modulate_voices(fluid_synth_t* synth, int chan, int is_cc, int ctrl)
 {
-  int i;
-  fluid_voice_t* voice;
-
 /*   fluid_mutex_lock(synth->busy); /\* Don't interfere with the audio thread *\/ */
 /*   fluid_mutex_unlock(synth->busy); */
 
-  for (i = 0; i < synth->polyphony; i++) {
-    voice = synth->voice[i];
-    if (voice->chan == chan) {
-      fluid_voice_modulate(voice, is_cc, ctrl);
-    }
+  /* Only the last value before a block is heard, so just note that
+   * the controller changed. fluid_synth_apply_pending_mods() does the
+   * rest. */
+  if (synth->coalesce_controllers) {
+    ctrl &= 0x7f;
+    synth->pending_mods[FLUID_PENDING_MODS_WORDS * chan + 4 * (is_cc != 0) + (ctrl >> 5)] |= 1u << (ctrl & 31);
+    synth->mods_pending = 1;
+    return FLUID_OK;
   }
+
+  fluid_synth_modulate_channel_voices(synth, chan, is_cc, ctrl);
   return FLUID_OK;
 }
 
@@ -1276,8 +1421,12 @@ fluid_synth_modulate_voices_all(fluid_synth_t* synth, int chan)
 /*   fluid_mutex_lock(synth->busy); /\* Don't interfere with the audio thread *\/ */
 /*   fluid_mutex_unlock(synth->busy); */
 
-  for (i = 0; i < synth->polyphony; i++) {
-    voice = synth->voice[i];
+  /* this covers anything held back for the channel */
+  FLUID_MEMSET(synth->pending_mods + FLUID_PENDING_MODS_WORDS * chan, 0,
+	       FLUID_PENDING_MODS_WORDS * sizeof(unsigned int));
+
+  for (i = 0; i < synth->nactive; i++) {
+    voice = synth->active_voice[i];
     if (voice->chan == chan) {
       fluid_voice_modulate_all(voice);
     }
@@ -1719,8 +1868,8 @@ void fluid_synth_set_gain(fluid_synth_t* synth, float gain)
   fluid_clip(gain, 0.0f, 10.0f);
   synth->gain = gain;
 
-  for (i = 0; i < synth->polyphony; i++) {
-    fluid_voice_t* voice = synth->voice[i];
+  for (i = 0; i < synth->nactive; i++) {
+    fluid_voice_t* voice = synth->active_voice[i];
     if (_PLAYING(voice)) {
       fluid_voice_set_gain(voice, gain);
     }
@@ -1735,6 +1884,85 @@ float fluid_synth_get_gain(fluid_synth_t* synth)
   return synth->gain;
 }
 
+/*
+ * fluid_synth_apply_pending_mods
+ *
+ * Modulates the voices once for each controller that changed since
+ * the last block, while controller changes are being coalesced.
+ */
+static void
+fluid_synth_apply_pending_mods(fluid_synth_t* synth)
+{
+  unsigned int* pending;
+  unsigned int bits;
+  int chan, w, b;
+
+  synth->mods_pending = 0;
+
+  for (chan = 0; chan < synth->midi_channels; chan++) {
+    pending = synth->pending_mods + FLUID_PENDING_MODS_WORDS * chan;
+
+    for (w = 0; w < FLUID_PENDING_MODS_WORDS; w++) {
+      bits = pending[w];
+      pending[w] = 0;
+
+      for (b = 0; bits != 0; b++, bits >>= 1) {
+	if (bits & 1) {
+	  fluid_synth_modulate_channel_voices(synth, chan, w >= 4, 32 * (w & 3) + b);
+	}
+      }
+    }
+  }
+}
+
+/*
+ * fluid_synth_set_coalesce_controllers
+ */
+void fluid_synth_set_coalesce_controllers(fluid_synth_t* synth, int coalesce)
+{
+  if (!coalesce && synth->mods_pending) {
+    fluid_synth_apply_pending_mods(synth);
+  }
+  synth->coalesce_controllers = (coalesce != 0);
+}
+
+/*
+ * fluid_synth_get_coalesce_controllers
+ */
+int fluid_synth_get_coalesce_controllers(fluid_synth_t* synth)
+{
+  return synth->coalesce_controllers;
+}
+
+/*
+ * fluid_synth_set_event_offset
+ */
+void fluid_synth_set_event_offset(fluid_synth_t* synth, int offset)
+{
+  synth->event_offset = (offset < 0) ? -1 : offset;
+}
+
+/*
+ * fluid_synth_get_event_offset
+ */
+int fluid_synth_get_event_offset(fluid_synth_t* synth)
+{
+  return synth->event_offset;
+}
+
+/*
+ * fluid_synth_event_offset
+ *
+ * The offset into the next block that an event arriving now takes
+ * effect at. Following cur puts every event one block after the frame
+ * being played when it arrived.
+ */
+static int
+fluid_synth_event_offset(fluid_synth_t* synth)
+{
+  return (synth->event_offset < 0) ? synth->cur : synth->event_offset;
+}
+
 /*
  * fluid_synth_update_polyphony
  */
@@ -1764,6 +1992,7 @@ int fluid_synth_set_polyphony(fluid_synth_t* synth, int polyphony)
   }
 
   synth->polyphony = polyphony;
+  fluid_synth_reset_voice_lists(synth);
 
   return FLUID_OK;
 }
@@ -1776,6 +2005,14 @@ int fluid_synth_get_polyphony(fluid_synth_t* synth)
   return synth->polyphony;
 }
 
+/*
+ * fluid_synth_get_active_voice_count
+ */
+int fluid_synth_get_active_voice_count(fluid_synth_t* synth)
+{
+  return synth->nactive;
+}
+
 /*
  * fluid_synth_get_internal_buffer_size
  */
@@ -1962,23 +2199,210 @@ int fluid_synth_process(fluid_synth_t* synth, int len,
 		       int nin, float** in,
 		       int nout, float** out)
 {
-  if (nout==2) {
-    return fluid_synth_write_float(synth, len, out[0], 0, 1, out[1], 0, 1);
+  /* the outputs are already laid out in left/right pairs */
+  return fluid_synth_write_float_buses(synth, len, nout, out);
+}
+
+
+/*
+ *  fluid_synth_write_float_direct
+ */
+int
+fluid_synth_write_float_direct(fluid_synth_t* synth, int len, float* left, float* right)
+{
+  float* out[2];
+  out[0] = left;
+  out[1] = right;
+  return fluid_synth_write_float_buses(synth, len, 2, out);
+}
+
+
+/*
+ *  fluid_synth_write_float_buses
+ */
+int
+fluid_synth_write_float_buses(fluid_synth_t* synth, int len, int nout, float** out)
+{
+  int i, k, num, count, nbus;
+
+  /* make sure we're playing */
+  if (synth->state != FLUID_SYNTH_PLAYING) {
+    return 0;
   }
-  else {
-    float **left, **right;
-    int i;
-    left = FLUID_ARRAY(float*, nout/2);
-    right = FLUID_ARRAY(float*, nout/2);
-    for(i=0; i<nout/2; i++) {
-      left[i] = out[2*i];
-      right[i] = out[2*i+1];
-    }
-    fluid_synth_nwrite_float(synth, len, left, right, NULL, NULL);
-    FLUID_FREE(left);
-    FLUID_FREE(right);
+
+  /* outputs past the synth's buffers stay silent */
+  nbus = nout / 2;
+  if (nbus > synth->nbuf) {
+    for (i = 2 * synth->nbuf; i < nout; i++) {
+      FLUID_MEMSET(out[i], 0, len * sizeof(float));
+    }
+    nbus = synth->nbuf;
+  }
+
+  /* First, take what's still available in the buffers */
+  count = 0;
+  if (synth->cur < FLUID_BUFSIZE) {
+    num = FLUID_BUFSIZE - synth->cur;
+    num = (num > len)? len : num;
+
+    for (k = 0; k < nbus; k++) {
+      for (i = 0; i < num; i++) {
+	out[2 * k][i] = (float) synth->left_buf[k][synth->cur + i];
+	out[2 * k + 1][i] = (float) synth->right_buf[k][synth->cur + i];
+      }
+    }
+    synth->cur += num;
+    count += num;
+  }
+
+#ifdef WITH_FLOAT
+  /* Whole blocks don't need staging: point the dry buffers at the
+     output and let one_block() render (and mix the effects) in place.
+     Nothing is left over in the buffers afterwards, so synth->cur
+     stays at FLUID_BUFSIZE. */
+  if (len - count >= FLUID_BUFSIZE) {
+    while (len - count >= FLUID_BUFSIZE) {
+      for (k = 0; k < nbus; k++) {
+	synth->left_buf[k] = out[2 * k] + count;
+	synth->right_buf[k] = out[2 * k + 1] + count;
+      }
+      fluid_synth_one_block(synth, 0);
+      count += FLUID_BUFSIZE;
+    }
+    for (k = 0; k < nbus; k++) {
+      synth->left_buf[k] = synth->left_stage[k];
+      synth->right_buf[k] = synth->right_stage[k];
+    }
+  }
+#endif
+
+  /* Then, run one_block() into the buffers and copy what we need */
+  while (count < len) {
+    fluid_synth_one_block(synth, 0);
+
+    num = (FLUID_BUFSIZE > len - count)? len - count : FLUID_BUFSIZE;
+    for (k = 0; k < nbus; k++) {
+      for (i = 0; i < num; i++) {
+	out[2 * k][count + i] = (float) synth->left_buf[k][i];
+	out[2 * k + 1][count + i] = (float) synth->right_buf[k][i];
+      }
+    }
+    synth->cur = num;
+    count += num;
+  }
+
+  return 0;
+}
+
+
+/*
+ *  fluid_synth_write_float_sends
+ */
+int
+fluid_synth_write_float_sends(fluid_synth_t* synth, int len, int nout, float** out,
+			      float* reverb_send, float* chorus_send)
+{
+  int i, k, num, count, nbus;
+
+  /* make sure we're playing */
+  if (synth->state != FLUID_SYNTH_PLAYING) {
     return 0;
   }
+
+  nbus = nout / 2;
+  if (nbus > synth->nbuf) {
+    for (i = 2 * synth->nbuf; i < nout; i++) {
+      FLUID_MEMSET(out[i], 0, len * sizeof(float));
+    }
+    nbus = synth->nbuf;
+  }
+
+  for (count = 0; count < len; count += num) {
+    if (synth->cur == FLUID_BUFSIZE) {
+      fluid_synth_one_block_dry(synth);
+      synth->cur = 0;
+    }
+
+    num = FLUID_BUFSIZE - synth->cur;
+    num = (num > len - count)? len - count : num;
+
+    for (k = 0; k < nbus; k++) {
+      for (i = 0; i < num; i++) {
+	out[2 * k][count + i] = (float) synth->left_buf[k][synth->cur + i];
+	out[2 * k + 1][count + i] = (float) synth->right_buf[k][synth->cur + i];
+      }
+    }
+
+    /* fx_left_buf holds the raw sends until the effects run */
+    if (reverb_send != NULL) {
+      for (i = 0; i < num; i++) {
+	reverb_send[count + i] = (float) synth->fx_left_buf[0][synth->cur + i];
+      }
+    }
+    if (chorus_send != NULL) {
+      for (i = 0; i < num; i++) {
+	chorus_send[count + i] = (float) synth->fx_left_buf[1][synth->cur + i];
+      }
+    }
+
+    synth->cur += num;
+  }
+
+  return 0;
+}
+
+/*
+ *  fluid_synth_mix_fx
+ */
+int
+fluid_synth_mix_fx(fluid_synth_t* synth, int len,
+		   float* reverb_send, float* chorus_send,
+		   float* left, float* right)
+{
+  fluid_real_t in[FLUID_BUFSIZE];
+  fluid_real_t left_buf[FLUID_BUFSIZE];
+  fluid_real_t right_buf[FLUID_BUFSIZE];
+  int i, count;
+
+  if (len % FLUID_BUFSIZE != 0) {
+    FLUID_LOG(FLUID_ERR, "Effects need whole blocks of %d samples", FLUID_BUFSIZE);
+    return FLUID_FAILED;
+  }
+
+  if (! synth->with_reverb) {
+    reverb_send = NULL;
+  }
+  if (! synth->with_chorus) {
+    chorus_send = NULL;
+  }
+
+  for (count = 0; count < len; count += FLUID_BUFSIZE) {
+    for (i = 0; i < FLUID_BUFSIZE; i++) {
+      left_buf[i] = left[count + i];
+      right_buf[i] = right[count + i];
+    }
+
+    if (reverb_send != NULL) {
+      for (i = 0; i < FLUID_BUFSIZE; i++) {
+	in[i] = reverb_send[count + i];
+      }
+      fluid_revmodel_processmix(synth->reverb, in, left_buf, right_buf);
+    }
+
+    if (chorus_send != NULL) {
+      for (i = 0; i < FLUID_BUFSIZE; i++) {
+	in[i] = chorus_send[count + i];
+      }
+      fluid_chorus_processmix(synth->chorus, in, left_buf, right_buf);
+    }
+
+    for (i = 0; i < FLUID_BUFSIZE; i++) {
+      left[count + i] = (float) left_buf[i];
+      right[count + i] = (float) right_buf[i];
+    }
+  }
+
+  return FLUID_OK;
 }
 
 
@@ -2150,30 +2574,329 @@ fluid_synth_dither_s16(int *dither_index, int len, float* lin, float* rin,
   *dither_index = di;	/* keep dither buffer continous */
 }
 
+/* the fewest playing voices worth waking the workers for, and the
+   fewest for each thread that renders them */
+#define FLUID_MIN_PARALLEL_VOICES  16
+#define FLUID_MIN_VOICES_PER_CORE  2
+
+/* how many times the audio thread looks at the workers' count before
+   it goes to sleep on workers_done */
+#define FLUID_WORKERS_SPIN  4096
+
+/* how many voice filters are set up together */
+#define FLUID_FILTER_BATCH  64
+
 /*
- *  fluid_synth_one_block
+ * fluid_synth_start_workers
+ *
+ * Starts cpu_cores - 1 threads that help the audio thread render the
+ * voices in fluid_synth_one_block().
  */
-int
-fluid_synth_one_block(fluid_synth_t* synth, int do_not_mix_fx_to_out)
+static int
+fluid_synth_start_workers(fluid_synth_t* synth)
 {
-  int i, auchan;
-  fluid_voice_t* voice;
-  fluid_real_t* left_buf;
-  fluid_real_t* right_buf;
-  fluid_real_t* reverb_buf;
-  fluid_real_t* chorus_buf;
-  int byte_size = FLUID_BUFSIZE * sizeof(fluid_real_t);
+  int i;
+  fluid_synth_worker_t* worker;
 
-/*   fluid_mutex_lock(synth->busy); /\* Here comes the audio thread. Lock the synth. *\/ */
+  synth->jobs = FLUID_ARRAY(fluid_voice_t*, synth->nvoice);
+  synth->jobs_group = FLUID_ARRAY(int, synth->nvoice);
+  synth->workers = FLUID_ARRAY(fluid_synth_worker_t, synth->cpu_cores - 1);
+  synth->workers_start = new_fluid_sem();
+  synth->workers_done = new_fluid_sem();
 
-  /* clean the audio buffers */
-  for (i = 0; i < synth->nbuf; i++) {
-    FLUID_MEMSET(synth->left_buf[i], 0, byte_size);
-    FLUID_MEMSET(synth->right_buf[i], 0, byte_size);
+  if ((synth->jobs == NULL) || (synth->jobs_group == NULL) || (synth->workers == NULL)
+      || (synth->workers_start == NULL) || (synth->workers_done == NULL)) {
+    FLUID_LOG(FLUID_ERR, "Out of memory");
+    return FLUID_FAILED;
   }
 
-  for (i = 0; i < synth->effects_channels; i++) {
-    FLUID_MEMSET(synth->fx_left_buf[i], 0, byte_size);
+  FLUID_MEMSET(synth->workers, 0, (synth->cpu_cores - 1) * sizeof(fluid_synth_worker_t));
+  synth->workers_quit = 0;
+
+  for (i = 0; i < synth->cpu_cores - 1; i++) {
+    worker = &synth->workers[i];
+    worker->synth = synth;
+    worker->index = i + 1;
+    worker->buf = FLUID_ARRAY(fluid_real_t, (2 * synth->audio_groups + 2) * FLUID_BUFSIZE);
+    if (worker->buf == NULL) {
+      FLUID_LOG(FLUID_ERR, "Out of memory");
+      return FLUID_FAILED;
+    }
+  }
+
+  for (i = 0; i < synth->cpu_cores - 1; i++) {
+    synth->workers[i].thread = new_fluid_thread(fluid_synth_worker, &synth->workers[i], 1);
+    if (synth->workers[i].thread == NULL) {
+      return FLUID_FAILED;
+    }
+  }
+
+  return FLUID_OK;
+}
+
+/*
+ * fluid_synth_stop_workers
+ */
+static void
+fluid_synth_stop_workers(fluid_synth_t* synth)
+{
+  int i;
+
+  if (synth->workers != NULL) {
+    synth->workers_quit = 1;
+
+    for (i = 0; i < synth->cpu_cores - 1; i++) {
+      if (synth->workers[i].thread != NULL) {
+        fluid_sem_post(synth->workers_start, 1);
+      }
+    }
+
+    for (i = 0; i < synth->cpu_cores - 1; i++) {
+      if (synth->workers[i].thread != NULL) {
+        fluid_thread_join(synth->workers[i].thread);
+        delete_fluid_thread(synth->workers[i].thread);
+      }
+      if (synth->workers[i].buf != NULL) {
+        FLUID_FREE(synth->workers[i].buf);
+      }
+    }
+    FLUID_FREE(synth->workers);
+    synth->workers = NULL;
+  }
+
+  if (synth->workers_start != NULL) {
+    delete_fluid_sem(synth->workers_start);
+  }
+  if (synth->workers_done != NULL) {
+    delete_fluid_sem(synth->workers_done);
+  }
+  if (synth->jobs != NULL) {
+    FLUID_FREE(synth->jobs);
+  }
+  if (synth->jobs_group != NULL) {
+    FLUID_FREE(synth->jobs_group);
+  }
+}
+
+/*
+ * fluid_synth_update_filters
+ */
+static void
+fluid_synth_update_filters(fluid_voice_t** voices, const fluid_real_t* omega, int count)
+{
+  fluid_real_t sin_omega[FLUID_FILTER_BATCH];
+  fluid_real_t cos_omega[FLUID_FILTER_BATCH];
+  int k;
+
+  fluid_sincos(omega, sin_omega, cos_omega, count);
+
+  for (k = 0; k < count; k++) {
+    fluid_voice_update_filter(voices[k], sin_omega[k], cos_omega[k]);
+  }
+}
+
+/*
+ * fluid_synth_update_control
+ *
+ * Runs the control rate part of the block (envelopes, LFOs, amplitude,
+ * pitch and filter) for all the playing voices, before any audio is
+ * rendered. The voices whose filter moved are collected, so that their
+ * coefficients are worked out in batches.
+ */
+static void
+fluid_synth_update_control(fluid_synth_t* synth)
+{
+  fluid_voice_t* filter_voices[FLUID_FILTER_BATCH];
+  fluid_real_t omega[FLUID_FILTER_BATCH];
+  fluid_voice_t* voice;
+  int i, n = 0;
+
+  for (i = 0; i < synth->nactive; i++) {
+    voice = synth->active_voice[i];
+
+    if (_PLAYING(voice) && fluid_voice_update_control(voice, &omega[n])) {
+      filter_voices[n++] = voice;
+
+      if (n == FLUID_FILTER_BATCH) {
+        fluid_synth_update_filters(filter_voices, omega, n);
+        n = 0;
+      }
+    }
+  }
+
+  if (n > 0) {
+    fluid_synth_update_filters(filter_voices, omega, n);
+  }
+}
+
+/*
+ * fluid_synth_render_jobs
+ *
+ * Renders the jobs first .. last - 1 of the current block, in order.
+ * With buf NULL they go straight into the synth's buffers, otherwise
+ * into buf, which holds the left and right buffer of each audio group
+ * and then the reverb and chorus sends.
+ */
+static void
+fluid_synth_render_jobs(fluid_synth_t* synth, int first, int last, fluid_real_t* buf,
+                        fluid_real_t* reverb_buf, fluid_real_t* chorus_buf)
+{
+  int k, group;
+
+  for (k = first; k < last; k++) {
+    group = synth->jobs_group[k];
+    if (buf == NULL) {
+      fluid_voice_write(synth->jobs[k], synth->left_buf[group], synth->right_buf[group],
+                        reverb_buf, chorus_buf);
+    } else {
+      fluid_voice_write(synth->jobs[k], buf + 2 * group * FLUID_BUFSIZE,
+                        buf + (2 * group + 1) * FLUID_BUFSIZE, reverb_buf, chorus_buf);
+    }
+  }
+}
+
+/*
+ * fluid_synth_worker
+ *
+ * Renders the worker's share of each block it is woken for into its
+ * own buffers.
+ */
+static void
+fluid_synth_worker(void* data)
+{
+  fluid_synth_worker_t* worker = (fluid_synth_worker_t*) data;
+  fluid_synth_t* synth = worker->synth;
+  int fx_offset = 2 * synth->audio_groups * FLUID_BUFSIZE;
+
+  while (1) {
+    fluid_sem_wait(synth->workers_start);
+    if (synth->workers_quit) {
+      return;
+    }
+
+    FLUID_MEMSET(worker->buf, 0, (fx_offset + 2 * FLUID_BUFSIZE) * sizeof(fluid_real_t));
+    fluid_synth_render_jobs(synth,
+                            synth->num_jobs * worker->index / synth->cpu_cores,
+                            synth->num_jobs * (worker->index + 1) / synth->cpu_cores,
+                            worker->buf,
+                            synth->with_reverb ? worker->buf + fx_offset : NULL,
+                            synth->with_chorus ? worker->buf + fx_offset + FLUID_BUFSIZE : NULL);
+
+    /* posted before the count goes down, so that the audio thread
+       never blocks on workers_done once it has seen the count at 0 */
+    fluid_sem_post(synth->workers_done, 1);
+    fluid_atomic_int_dec(&synth->workers_busy);
+  }
+}
+
+/*
+ * fluid_synth_render_voices_parallel
+ *
+ * Renders the playing voices on cpu_cores threads. Each thread gets a
+ * fixed, contiguous share of the voices in active list order: the
+ * audio thread renders the first share straight into the output, the
+ * workers render the others into their own buffers, which are then
+ * added to the output in worker order. The result therefore only
+ * depends on the voices and the number of threads, not on timing. It
+ * is rounded differently from the single threaded loop, which sums
+ * every voice into the output in turn.
+ *
+ * With few voices, waking the workers costs more than it saves, and
+ * the audio thread renders them all as the single threaded loop does.
+ */
+static void
+fluid_synth_render_voices_parallel(fluid_synth_t* synth,
+                                   fluid_real_t* reverb_buf,
+                                   fluid_real_t* chorus_buf)
+{
+  int i, j, g, spin, num_workers;
+  int fx_offset = 2 * synth->audio_groups * FLUID_BUFSIZE;
+  fluid_voice_t* voice;
+  fluid_real_t* buf;
+  fluid_real_t* left_buf;
+  fluid_real_t* right_buf;
+
+  synth->num_jobs = 0;
+  for (i = 0; i < synth->nactive; i++) {
+    voice = synth->active_voice[i];
+    if (_PLAYING(voice) && voice->dsp->render) {
+      synth->jobs[synth->num_jobs] = voice;
+      synth->jobs_group[synth->num_jobs] =
+        fluid_channel_get_num(fluid_voice_get_channel(voice)) % synth->audio_groups;
+      synth->num_jobs++;
+    }
+  }
+
+  if ((synth->num_jobs < FLUID_MIN_PARALLEL_VOICES)
+      || (synth->num_jobs < FLUID_MIN_VOICES_PER_CORE * synth->cpu_cores)) {
+    fluid_synth_render_jobs(synth, 0, synth->num_jobs, NULL, reverb_buf, chorus_buf);
+    return;
+  }
+
+  num_workers = synth->cpu_cores - 1;
+  synth->workers_busy = num_workers;
+  fluid_sem_post(synth->workers_start, num_workers);
+
+  fluid_synth_render_jobs(synth, 0, synth->num_jobs / synth->cpu_cores, NULL,
+                          reverb_buf, chorus_buf);
+
+  /* The workers usually finish about when the audio thread does, so
+   * it looks for that for a while before it sleeps. */
+  for (spin = 0; (spin < FLUID_WORKERS_SPIN) && (fluid_atomic_int_get(&synth->workers_busy) > 0); spin++) {
+  }
+  for (i = 0; i < num_workers; i++) {
+    fluid_sem_wait(synth->workers_done);
+  }
+
+  for (i = 0; i < num_workers; i++) {
+    buf = synth->workers[i].buf;
+
+    for (g = 0; g < synth->audio_groups; g++) {
+      left_buf = synth->left_buf[g];
+      right_buf = synth->right_buf[g];
+      for (j = 0; j < FLUID_BUFSIZE; j++) {
+        left_buf[j] += buf[2 * g * FLUID_BUFSIZE + j];
+        right_buf[j] += buf[(2 * g + 1) * FLUID_BUFSIZE + j];
+      }
+    }
+    if (reverb_buf) {
+      for (j = 0; j < FLUID_BUFSIZE; j++) {
+        reverb_buf[j] += buf[fx_offset + j];
+      }
+    }
+    if (chorus_buf) {
+      for (j = 0; j < FLUID_BUFSIZE; j++) {
+        chorus_buf[j] += buf[fx_offset + FLUID_BUFSIZE + j];
+      }
+    }
+  }
+}
+
+/*
+ *  fluid_synth_one_block_dry
+ *
+ *  Renders the voices of one block into the dry buffers and the reverb
+ *  and chorus sends, without running the effects.
+ */
+static void
+fluid_synth_one_block_dry(fluid_synth_t* synth)
+{
+  int i, auchan;
+  fluid_voice_t* voice;
+  fluid_real_t* left_buf;
+  fluid_real_t* right_buf;
+  fluid_real_t* reverb_buf;
+  fluid_real_t* chorus_buf;
+  int byte_size = FLUID_BUFSIZE * sizeof(fluid_real_t);
+
+  /* clean the audio buffers */
+  for (i = 0; i < synth->nbuf; i++) {
+    FLUID_MEMSET(synth->left_buf[i], 0, byte_size);
+    FLUID_MEMSET(synth->right_buf[i], 0, byte_size);
+  }
+
+  for (i = 0; i < synth->effects_channels; i++) {
+    FLUID_MEMSET(synth->fx_left_buf[i], 0, byte_size);
     FLUID_MEMSET(synth->fx_right_buf[i], 0, byte_size);
   }
 
@@ -2184,32 +2907,69 @@ fluid_synth_one_block(fluid_synth_t* synth, int do_not_mix_fx_to_out)
   reverb_buf = synth->with_reverb ? synth->fx_left_buf[0] : NULL;
   chorus_buf = synth->with_chorus ? synth->fx_left_buf[1] : NULL;
 
-  /* call all playing synthesis processes */
-  for (i = 0; i < synth->polyphony; i++) {
-    voice = synth->voice[i];
+  if (synth->mods_pending) {
+    fluid_synth_apply_pending_mods(synth);
+  }
 
-    if (_PLAYING(voice)) {
-      /* The output associated with a MIDI channel is wrapped around
-       * using the number of audio groups as modulo divider.  This is
-       * typically the number of output channels on the 'sound card',
-       * as long as the LADSPA Fx unit is not used. In case of LADSPA
-       * unit, think of it as subgroups on a mixer.
-       *
-       * For example: Assume that the number of groups is set to 2.
-       * Then MIDI channel 1, 3, 5, 7 etc. go to output 1, channels 2,
-       * 4, 6, 8 etc to output 2.  Or assume 3 groups: Then MIDI
-       * channels 1, 4, 7, 10 etc go to output 1; 2, 5, 8, 11 etc to
-       * output 2, 3, 6, 9, 12 etc to output 3.
-       */
-      auchan = fluid_channel_get_num(fluid_voice_get_channel(voice));
-      auchan %= synth->audio_groups;
-      left_buf = synth->left_buf[auchan];
-      right_buf = synth->right_buf[auchan];
-
-      fluid_voice_write(voice, left_buf, right_buf, reverb_buf, chorus_buf);
+  fluid_synth_update_control(synth);
+
+  /* call all playing synthesis processes */
+  if (synth->cpu_cores > 1) {
+    fluid_synth_render_voices_parallel(synth, reverb_buf, chorus_buf);
+  } else {
+    for (i = 0; i < synth->nactive; i++) {
+      voice = synth->active_voice[i];
+
+      if (_PLAYING(voice)) {
+        /* The output associated with a MIDI channel is wrapped around
+         * using the number of audio groups as modulo divider.  This is
+         * typically the number of output channels on the 'sound card',
+         * as long as the LADSPA Fx unit is not used. In case of LADSPA
+         * unit, think of it as subgroups on a mixer.
+         *
+         * For example: Assume that the number of groups is set to 2.
+         * Then MIDI channel 1, 3, 5, 7 etc. go to output 1, channels 2,
+         * 4, 6, 8 etc to output 2.  Or assume 3 groups: Then MIDI
+         * channels 1, 4, 7, 10 etc go to output 1; 2, 5, 8, 11 etc to
+         * output 2, 3, 6, 9, 12 etc to output 3.
+         */
+        auchan = fluid_channel_get_num(fluid_voice_get_channel(voice));
+        auchan %= synth->audio_groups;
+        left_buf = synth->left_buf[auchan];
+        right_buf = synth->right_buf[auchan];
+
+        fluid_voice_write(voice, left_buf, right_buf, reverb_buf, chorus_buf);
+      }
     }
   }
 
+  synth->ticks += FLUID_BUFSIZE;
+
+  /* hand the voices that finished during this block back to the free list */
+  fluid_synth_update_voice_lists(synth);
+
+  /* a full synth will have to steal a voice for the next note-on */
+  if (synth->nfree == 0) {
+    fluid_synth_build_steal_heap(synth);
+  }
+}
+
+/*
+ *  fluid_synth_one_block
+ */
+int
+fluid_synth_one_block(fluid_synth_t* synth, int do_not_mix_fx_to_out)
+{
+  fluid_real_t* reverb_buf;
+  fluid_real_t* chorus_buf;
+
+/*   fluid_mutex_lock(synth->busy); /\* Here comes the audio thread. Lock the synth. *\/ */
+
+  fluid_synth_one_block_dry(synth);
+
+  reverb_buf = synth->with_reverb ? synth->fx_left_buf[0] : NULL;
+  chorus_buf = synth->with_chorus ? synth->fx_left_buf[1] : NULL;
+
   /* if multi channel output, don't mix the output of the chorus and
      reverb in the final output. The effects outputs are send
      separately. */
@@ -2250,8 +3010,6 @@ fluid_synth_one_block(fluid_synth_t* synth, int do_not_mix_fx_to_out)
   fluid_check_fpe("LADSPA");
 #endif
 
-  synth->ticks += FLUID_BUFSIZE;
-
   /* Testcase, that provokes a denormal floating point error */
 #if 0
   {float num=1;while (num != 0){num*=0.5;};};
@@ -2264,83 +3022,328 @@ fluid_synth_one_block(fluid_synth_t* synth, int do_not_mix_fx_to_out)
 
 
 /*
- * fluid_synth_free_voice_by_kill
+ * fluid_synth_reset_voice_lists
  *
- * selects a voice for killing. the selection algorithm is a refinement
- * of the algorithm previously in fluid_synth_alloc_voice.
+ * Rebuilds the active and free lists from the voice array, after the
+ * voices or the polyphony changed. Voices above the polyphony are on
+ * neither list and are never handed out.
  */
-fluid_voice_t*
-fluid_synth_free_voice_by_kill(fluid_synth_t* synth)
+static void
+fluid_synth_reset_voice_lists(fluid_synth_t* synth)
 {
   int i;
-  fluid_real_t best_prio = 999999.;
-  fluid_real_t this_voice_prio;
-  fluid_voice_t* voice;
-  int best_voice_index=-1;
 
-/*   fluid_mutex_lock(synth->busy); /\* Don't interfere with the audio thread *\/ */
-/*   fluid_mutex_unlock(synth->busy); */
+  synth->nactive = 0;
+  synth->nfree = 0;
+  synth->steal_heap_valid = 0;
+
+  FLUID_MEMSET(synth->key_voices, 0, 128 * synth->midi_channels * sizeof(fluid_voice_t*));
+  for (i = 0; i < synth->nvoice; i++) {
+    synth->voice[i]->key_next = NULL;
+    synth->voice[i]->key_prevp = NULL;
+  }
 
   for (i = 0; i < synth->polyphony; i++) {
+    if (!_AVAILABLE(synth->voice[i])) {
+      synth->active_voice[synth->nactive++] = synth->voice[i];
+      fluid_synth_link_key_voice(synth, synth->voice[i]);
+    }
+  }
+
+  /* the free list is a stack, fill it so that the first voices go first */
+  for (i = synth->polyphony - 1; i >= 0; i--) {
+    if (_AVAILABLE(synth->voice[i])) {
+      synth->free_voice[synth->nfree++] = synth->voice[i];
+    }
+  }
+}
 
-    voice = synth->voice[i];
+/*
+ * fluid_synth_update_voice_lists
+ *
+ * Voices turn themselves off while they are rendered, possibly on
+ * another thread, so they can't take themselves off the active list.
+ * This moves the ones that are done to the free list, keeping the
+ * order of the others.
+ */
+static void
+fluid_synth_update_voice_lists(fluid_synth_t* synth)
+{
+  int i, k;
+  fluid_voice_t* voice;
 
-    /* safeguard against an available voice. */
+  for (i = 0, k = 0; i < synth->nactive; i++) {
+    voice = synth->active_voice[i];
     if (_AVAILABLE(voice)) {
-      return voice;
+      fluid_synth_unlink_key_voice(voice);
+      synth->free_voice[synth->nfree++] = voice;
+    } else {
+      synth->active_voice[k++] = voice;
     }
+  }
+  if (k < synth->nactive) {
+    synth->steal_heap_valid = 0;
+  }
+  synth->nactive = k;
+}
+
+/*
+ * fluid_synth_link_key_voice
+ *
+ * Puts a voice at the head of the list for its channel and key. Keys
+ * above 127 share a list with key & 127, so walkers still compare the key.
+ */
+static void
+fluid_synth_link_key_voice(fluid_synth_t* synth, fluid_voice_t* voice)
+{
+  fluid_voice_t** head = &synth->key_voices[128 * voice->chan + (voice->key & 0x7f)];
+
+  voice->key_next = *head;
+  if (*head) {
+    (*head)->key_prevp = &voice->key_next;
+  }
+  *head = voice;
+  voice->key_prevp = head;
+}
+
+/*
+ * fluid_synth_unlink_key_voice
+ */
+static void
+fluid_synth_unlink_key_voice(fluid_voice_t* voice)
+{
+  if (voice->key_prevp == NULL) {
+    return;
+  }
+  *voice->key_prevp = voice->key_next;
+  if (voice->key_next) {
+    voice->key_next->key_prevp = voice->key_prevp;
+  }
+  voice->key_next = NULL;
+  voice->key_prevp = NULL;
+}
 
-    /* Determine, how 'important' a voice is.
-     * Start with an arbitrary number */
-    this_voice_prio = 10000.;
+/*
+ * fluid_synth_steal_priority
+ *
+ * Determines how 'important' a voice is, the lowest is killed first.
+ * The age is counted from synth->steal_noteid rather than the current
+ * noteid, which only shifts all the priorities by the same amount.
+ */
+static fluid_real_t
+fluid_synth_steal_priority(fluid_synth_t* synth, fluid_voice_t* voice)
+{
+  /* Start with an arbitrary number */
+  fluid_real_t prio = 10000.;
+
+  /* Is this voice on the drum channel?
+   * Then it is very important.
+   * Also, forget about the released-note condition:
+   * Typically, drum notes are triggered only very briefly, they run most
+   * of the time in release phase.
+   */
+  if (_RELEASED(voice)){
+    /* The key for this voice has been released. Consider it much less important
+     * than a voice, which is still held.
+     */
+    prio -= 2000.;
+  }
 
-    /* Is this voice on the drum channel?
-     * Then it is very important.
-     * Also, forget about the released-note condition:
-     * Typically, drum notes are triggered only very briefly, they run most
-     * of the time in release phase.
+  if (_SUSTAINED(voice)){
+    /* The sustain pedal is held down on this channel.
+     * Consider it less important than non-sustained channels.
+     * This decision is somehow subjective. But usually the sustain pedal
+     * is used to play 'more-voices-than-fingers', so it shouldn't hurt
+     * if we kill one voice.
      */
-    if (_RELEASED(voice)){
-      /* The key for this voice has been released. Consider it much less important
-       * than a voice, which is still held.
-       */
-      this_voice_prio -= 2000.;
-    }
+    prio -= 1000;
+  }
+
+  /* We are not enthusiastic about releasing voices, which have just been started.
+   * Otherwise hitting a chord may result in killing notes belonging to that very same
+   * chord.
+   * So subtract the age of the voice from the priority - an older voice is just a little
+   * bit less important than a younger voice.
+   * This is a number between roughly 0 and 100.*/
+  prio -= (int) (synth->steal_noteid - fluid_voice_get_id(voice));
 
-    if (_SUSTAINED(voice)){
-      /* The sustain pedal is held down on this channel.
-       * Consider it less important than non-sustained channels.
-       * This decision is somehow subjective. But usually the sustain pedal
-       * is used to play 'more-voices-than-fingers', so it shouldn't hurt
-       * if we kill one voice.
-       */
-      this_voice_prio -= 1000;
+  /* take a rough estimate of loudness into account. Louder voices are more important. */
+  if (voice->dsp->volenv_section != FLUID_VOICE_ENVATTACK){
+    prio += voice->dsp->volenv_val * 1000.;
+  }
+
+  return prio;
+}
+
+/*
+ * fluid_synth_sift_up_steal_heap
+ */
+static void
+fluid_synth_sift_up_steal_heap(fluid_synth_t* synth, int i)
+{
+  fluid_voice_t** heap = synth->steal_heap;
+  fluid_voice_t* voice = heap[i];
+  int parent;
+
+  while (i > 0) {
+    parent = (i - 1) / 2;
+    if (heap[parent]->steal_prio <= voice->steal_prio) {
+      break;
     }
+    heap[i] = heap[parent];
+    heap[i]->steal_index = i;
+    i = parent;
+  }
+  heap[i] = voice;
+  voice->steal_index = i;
+}
 
-    /* We are not enthusiastic about releasing voices, which have just been started.
-     * Otherwise hitting a chord may result in killing notes belonging to that very same
-     * chord.
-     * So subtract the age of the voice from the priority - an older voice is just a little
-     * bit less important than a younger voice.
-     * This is a number between roughly 0 and 100.*/
-    this_voice_prio -= (synth->noteid - fluid_voice_get_id(voice));
+/*
+ * fluid_synth_sift_down_steal_heap
+ */
+static void
+fluid_synth_sift_down_steal_heap(fluid_synth_t* synth, int i)
+{
+  fluid_voice_t** heap = synth->steal_heap;
+  fluid_voice_t* voice = heap[i];
+  int child;
 
-    /* take a rough estimate of loudness into account. Louder voices are more important. */
-    if (voice->volenv_section != FLUID_VOICE_ENVATTACK){
-      this_voice_prio += voice->volenv_val * 1000.;
+  while ((child = 2 * i + 1) < synth->nsteal) {
+    if ((child + 1 < synth->nsteal) && (heap[child + 1]->steal_prio < heap[child]->steal_prio)) {
+      child++;
+    }
+    if (heap[child]->steal_prio >= voice->steal_prio) {
+      break;
     }
+    heap[i] = heap[child];
+    heap[i]->steal_index = i;
+    i = child;
+  }
+  heap[i] = voice;
+  voice->steal_index = i;
+}
+
+/*
+ * fluid_synth_build_steal_heap
+ *
+ * Works out the priority of every active voice and puts them in the
+ * heap. After that, only note-offs move voices in the heap, the
+ * envelopes are caught up with at the next build, at most once per
+ * block.
+ */
+static void
+fluid_synth_build_steal_heap(fluid_synth_t* synth)
+{
+  int i;
+  fluid_voice_t* voice;
+
+  synth->steal_noteid = synth->noteid;
+  synth->nsteal = 0;
+
+  for (i = 0; i < synth->nactive; i++) {
+    voice = synth->active_voice[i];
+    voice->steal_prio = fluid_synth_steal_priority(synth, voice);
+    voice->steal_index = synth->nsteal;
+    synth->steal_heap[synth->nsteal++] = voice;
+  }
 
-    /* check if this voice has less priority than the previous candidate. */
-    if (this_voice_prio < best_prio)
-        (void)(best_voice_index = i),
-      best_prio = this_voice_prio;
+  for (i = synth->nsteal / 2 - 1; i >= 0; i--) {
+    fluid_synth_sift_down_steal_heap(synth, i);
   }
 
-  if (best_voice_index < 0) {
+  synth->steal_heap_valid = 1;
+}
+
+/*
+ * fluid_synth_push_steal_heap
+ */
+static void
+fluid_synth_push_steal_heap(fluid_synth_t* synth, fluid_voice_t* voice)
+{
+  voice->steal_prio = fluid_synth_steal_priority(synth, voice);
+  synth->steal_heap[synth->nsteal] = voice;
+  fluid_synth_sift_up_steal_heap(synth, synth->nsteal++);
+}
+
+/*
+ * fluid_synth_pop_steal_heap
+ */
+static fluid_voice_t*
+fluid_synth_pop_steal_heap(fluid_synth_t* synth)
+{
+  fluid_voice_t* voice;
+
+  if (synth->nsteal == 0) {
+    return NULL;
+  }
+
+  voice = synth->steal_heap[0];
+  voice->steal_index = -1;
+  synth->nsteal--;
+  if (synth->nsteal > 0) {
+    synth->steal_heap[0] = synth->steal_heap[synth->nsteal];
+    fluid_synth_sift_down_steal_heap(synth, 0);
+  }
+
+  return voice;
+}
+
+/*
+ * fluid_synth_update_steal_heap
+ *
+ * Moves a voice after a note-off, which can change its priority a lot
+ * from one event to the next.
+ */
+static void
+fluid_synth_update_steal_heap(fluid_synth_t* synth, fluid_voice_t* voice)
+{
+  int i = voice->steal_index;
+  fluid_real_t prio;
+
+  if (!synth->steal_heap_valid || (i < 0) || (i >= synth->nsteal)
+      || (synth->steal_heap[i] != voice)) {
+    return;
+  }
+
+  prio = voice->steal_prio;
+  voice->steal_prio = fluid_synth_steal_priority(synth, voice);
+  if (voice->steal_prio < prio) {
+    fluid_synth_sift_up_steal_heap(synth, i);
+  } else {
+    fluid_synth_sift_down_steal_heap(synth, i);
+  }
+}
+
+/*
+ * fluid_synth_free_voice_by_kill
+ *
+ * selects a voice for killing. the selection algorithm is a refinement
+ * of the algorithm previously in fluid_synth_alloc_voice.
+ */
+fluid_voice_t*
+fluid_synth_free_voice_by_kill(fluid_synth_t* synth)
+{
+  fluid_voice_t* voice;
+
+/*   fluid_mutex_lock(synth->busy); /\* Don't interfere with the audio thread *\/ */
+/*   fluid_mutex_unlock(synth->busy); */
+
+  /* The heap is normally built at the end of the block that filled up
+     the synth, so a burst of note-ons only pays for the pops. */
+  if (!synth->steal_heap_valid || (synth->nsteal == 0)) {
+    fluid_synth_build_steal_heap(synth);
+  }
+
+  voice = fluid_synth_pop_steal_heap(synth);
+  if (voice == NULL) {
     return NULL;
   }
 
-  voice = synth->voice[best_voice_index];
+  /* safeguard against an available voice. */
+  if (_AVAILABLE(voice)) {
+    return voice;
+  }
+
   fluid_voice_off(voice);
 
   return voice;
@@ -2359,15 +3362,18 @@ fluid_synth_alloc_voice(fluid_synth_t* synth, fluid_sample_t* sample, int chan,
 /*   fluid_mutex_lock(synth->busy); /\* Don't interfere with the audio thread *\/ */
 /*   fluid_mutex_unlock(synth->busy); */
 
-  /* check if there's an available synthesis process */
-  for (i = 0; i < synth->polyphony; i++) {
-    if (_AVAILABLE(synth->voice[i])) {
-      voice = synth->voice[i];
-      break;
-    }
+  /* check if there's an available synthesis process. Voices that
+     ended since the last block are still on the active list. */
+  if (synth->nfree == 0) {
+    fluid_synth_update_voice_lists(synth);
+  }
+  if (synth->nfree > 0) {
+    voice = synth->free_voice[--synth->nfree];
+    synth->active_voice[synth->nactive++] = voice;
   }
 
-  /* No success yet? Then stop a running voice. */
+  /* No success yet? Then stop a running voice. It stays where it is
+     on the active list. */
   if (voice == NULL) {
     voice = fluid_synth_free_voice_by_kill(synth);
   }
@@ -2377,10 +3383,13 @@ fluid_synth_alloc_voice(fluid_synth_t* synth, fluid_sample_t* sample, int chan,
     return NULL;
   }
 
+  /* a stolen voice is still listed under its old key */
+  fluid_synth_unlink_key_voice(voice);
+
   if (synth->verbose) {
     k = 0;
-    for (i = 0; i < synth->polyphony; i++) {
-      if (!_AVAILABLE(synth->voice[i])) {
+    for (i = 0; i < synth->nactive; i++) {
+      if (!_AVAILABLE(synth->active_voice[i])) {
 	k++;
       }
     }
@@ -2401,6 +3410,19 @@ fluid_synth_alloc_voice(fluid_synth_t* synth, fluid_sample_t* sample, int chan,
     FLUID_LOG(FLUID_WARN, "Failed to initialize voice");
     return NULL;
   }
+  fluid_synth_link_key_voice(synth, voice);
+
+  /* only a stolen voice can be started while the heap is valid */
+  if (synth->steal_heap_valid) {
+    fluid_synth_push_steal_heap(synth, voice);
+  }
+
+  /* Like the sample, the soundfont must stay around while the voice
+     plays, even if it is unloaded or swapped out in the meantime. */
+  voice->sfont = synth->storesfont;
+  if (voice->sfont) {
+    fluid_sfont_incr_ref(voice->sfont);
+  }
 
   /* add the default modulators to the synthesis process. */
   fluid_voice_add_mod(voice, &default_vel2att_mod, FLUID_VOICE_DEFAULT);    /* SF2.01 $8.4.1  */
@@ -2447,8 +3469,8 @@ void fluid_synth_kill_by_exclusive_class(fluid_synth_t* synth, fluid_voice_t* ne
 
     /* Kill all notes on the same channel with the same exclusive class */
 
-  for (i = 0; i < synth->polyphony; i++) {
-    fluid_voice_t* existing_voice = synth->voice[i];
+  for (i = 0; i < synth->nactive; i++) {
+    fluid_voice_t* existing_voice = synth->active_voice[i];
 
     /* Existing voice does not play? Leave it alone. */
     if (!_PLAYING(existing_voice)) {
@@ -2476,6 +3498,7 @@ void fluid_synth_kill_by_exclusive_class(fluid_synth_t* synth, fluid_voice_t* ne
     //     (int)_GEN(existing_voice, GEN_EXCLUSIVECLASS), (int)fluid_voice_get_id(existing_voice));
 
     fluid_voice_kill_excl(existing_voice);
+    fluid_synth_update_steal_heap(synth, existing_voice);
   };
 };
 
@@ -2494,6 +3517,7 @@ void fluid_synth_start_voice(fluid_synth_t* synth, fluid_voice_t* voice)
 
   /* Start the new voice */
 
+  fluid_voice_set_start_offset(voice, fluid_synth_event_offset(synth));
   fluid_voice_start(voice);
 }
 
@@ -2569,6 +3593,28 @@ void fluid_synth_sfunload_macos9(fluid_synth_t* synth)
 #endif
 }
 
+/*
+ * fluid_synth_unlink_sfont
+ */
+static void fluid_synth_unlink_sfont(fluid_synth_t* synth, fluid_sfont_t* sfont)
+{
+  fluid_list_t* list;
+
+  if (synth->sfont_spare != NULL) {
+    synth->sfont = fluid_list_remove(synth->sfont, sfont);
+    return;
+  }
+
+  /* keep the node, so that swapping onto an empty stack needn't allocate */
+  for (list = synth->sfont; list; list = fluid_list_next(list)) {
+    if ((fluid_sfont_t*) fluid_list_get(list) == sfont) {
+      synth->sfont = fluid_list_remove_link(synth->sfont, list);
+      synth->sfont_spare = list;
+      return;
+    }
+  }
+}
+
 /*
  * fluid_synth_sfunload
  */
@@ -2587,7 +3633,7 @@ fluid_synth_sfunload(fluid_synth_t* synth, unsigned int id, int reset_presets)
   }
 
   /* remove the SoundFont from the list */
-  synth->sfont = fluid_list_remove(synth->sfont, sfont);
+  fluid_synth_unlink_sfont(synth, sfont);
 
   /* reset the presets for all channels */
   if (reset_presets) {
@@ -2693,7 +3739,7 @@ void fluid_synth_remove_sfont(fluid_synth_t* synth, fluid_sfont_t* sfont)
 {
 	int sfont_id = fluid_sfont_get_id(sfont);
 
-	synth->sfont = fluid_list_remove(synth->sfont, sfont);
+	fluid_synth_unlink_sfont(synth, sfont);
 
 	/* remove a possible bank offset */
 	fluid_synth_remove_bank_offset(synth, sfont_id);
@@ -2703,6 +3749,146 @@ void fluid_synth_remove_sfont(fluid_synth_t* synth, fluid_sfont_t* sfont)
 }
 
 
+/*
+ * fluid_synth_load_sfont
+ */
+fluid_sfont_t* fluid_synth_load_sfont(fluid_synth_t* synth, const char* filename)
+{
+  fluid_list_t *list;
+  fluid_sfloader_t* loader;
+  fluid_sfont_t* sfont;
+
+  if (filename == NULL) {
+    FLUID_LOG(FLUID_ERR, "Invalid filename");
+    return NULL;
+  }
+
+  /* Only the loader list is read here, the synth itself is not touched,
+     so this can run while another thread is rendering. */
+  for (list = synth->loaders; list; list = fluid_list_next(list)) {
+    loader = (fluid_sfloader_t*) fluid_list_get(list);
+
+    sfont = fluid_sfloader_load(loader, filename);
+    if (sfont != NULL) {
+      sfont->id = 0;
+      return sfont;
+    }
+  }
+
+  FLUID_LOG(FLUID_ERR, "Failed to load SoundFont \"%s\"", filename);
+  return NULL;
+}
+
+
+/*
+ * fluid_synth_share_sfont
+ */
+static int fluid_synth_shared_sfont_delete(fluid_sfont_t* sfont)
+{
+  /* only the handle is ours, the data belongs to the original */
+  if (fluid_sfont_refcount(sfont) != 0) {
+    return -1;
+  }
+  if (sfont->presets != NULL) {
+    FLUID_FREE(sfont->presets);
+  }
+  FLUID_FREE(sfont);
+  return 0;
+}
+
+fluid_sfont_t* fluid_synth_share_sfont(fluid_sfont_t* sfont)
+{
+  fluid_sfont_t* handle;
+  unsigned int i;
+
+  handle = FLUID_NEW(fluid_sfont_t);
+  if (handle == NULL) {
+    FLUID_LOG(FLUID_ERR, "Out of memory");
+    return NULL;
+  }
+
+  FLUID_MEMCPY(handle, sfont, sizeof(fluid_sfont_t));
+  handle->id = 0;
+  handle->refcount = 0;
+  handle->free = fluid_synth_shared_sfont_delete;
+
+  /* the preset handles point back at their sfont, so every handle
+     needs its own copy of them */
+  if (sfont->presets != NULL) {
+    handle->presets = FLUID_ARRAY(fluid_preset_t, sfont->preset_count + 1);
+    if (handle->presets == NULL) {
+      FLUID_LOG(FLUID_ERR, "Out of memory");
+      FLUID_FREE(handle);
+      return NULL;
+    }
+    FLUID_MEMCPY(handle->presets, sfont->presets, sfont->preset_count * sizeof(fluid_preset_t));
+    for (i = 0; i < sfont->preset_count; i++) {
+      handle->presets[i].sfont = handle;
+    }
+  }
+
+  return handle;
+}
+
+
+/*
+ * fluid_synth_swap_sfont
+ */
+int fluid_synth_swap_sfont(fluid_synth_t* synth, fluid_sfont_t* old_sfont,
+			   fluid_sfont_t* new_sfont, int reset_presets)
+{
+  fluid_list_t* list;
+  fluid_bank_offset_t* bank_offset;
+
+  if (old_sfont == NULL) {
+    if (synth->sfont_spare == NULL) {
+      return fluid_synth_add_sfont(synth, new_sfont);
+    }
+
+    /* push it on the stack with the node kept aside for this */
+    list = synth->sfont_spare;
+    synth->sfont_spare = NULL;
+    list->data = new_sfont;
+    list->next = synth->sfont;
+    synth->sfont = list;
+
+    new_sfont->id = ++synth->sfont_id;
+
+  } else {
+    for (list = synth->sfont; list; list = fluid_list_next(list)) {
+      if ((fluid_sfont_t*) fluid_list_get(list) == old_sfont) {
+	break;
+      }
+    }
+
+    if (list == NULL) {
+      FLUID_LOG(FLUID_ERR, "No SoundFont with id = %d", fluid_sfont_get_id(old_sfont));
+      return FLUID_FAILED;
+    }
+
+    new_sfont->id = ++synth->sfont_id;
+
+    /* take over the old font's slot on the stack and its bank offset, so
+       that nothing is allocated or freed here */
+    list->data = new_sfont;
+
+    bank_offset = fluid_synth_get_bank_offset0(synth, fluid_sfont_get_id(old_sfont));
+    if (bank_offset != NULL) {
+      bank_offset->sfont_id = new_sfont->id;
+    }
+  }
+
+  /* the channels still point at the old font's presets */
+  if (reset_presets) {
+    fluid_synth_program_reset(synth);
+  } else {
+    fluid_synth_update_presets(synth);
+  }
+
+  return new_sfont->id;
+}
+
+
 /* fluid_synth_sfcount
  *
  * Returns the number of loaded SoundFonts
@@ -2780,8 +3966,8 @@ fluid_synth_get_voicelist(fluid_synth_t* synth, fluid_voice_t* buf[], int bufsiz
 {
   int i;
   int count = 0;
-  for (i = 0; i < synth->polyphony; i++) {
-    fluid_voice_t* voice = synth->voice[i];
+  for (i = 0; i < synth->nactive; i++) {
+    fluid_voice_t* voice = synth->active_voice[i];
     if (count >= bufsize) {
       return;
     }
@@ -2870,19 +4056,18 @@ double fluid_synth_get_reverb_width(fluid_synth_t* synth)
  * release those...
  */
 void fluid_synth_release_voice_on_same_note(fluid_synth_t* synth, int chan, int key){
-  int i;
   fluid_voice_t* voice;
 
 /*   fluid_mutex_lock(synth->busy); /\* Don't interfere with the audio thread *\/ */
 /*   fluid_mutex_unlock(synth->busy); */
 
-  for (i = 0; i < synth->polyphony; i++) {
-    voice = synth->voice[i];
+  for (voice = synth->key_voices[128 * chan + (key & 0x7f)]; voice; voice = voice->key_next) {
     if (_PLAYING(voice)
 	&& (voice->chan == chan)
 	&& (voice->key == key)
 	&& (fluid_voice_get_id(voice) != synth->noteid)) {
-      fluid_voice_noteoff(voice);
+      fluid_voice_noteoff_at(voice, fluid_synth_event_offset(synth));
+      fluid_synth_update_steal_heap(synth, voice);
     }
   }
 }
@@ -3292,8 +4477,8 @@ fluid_synth_set_gen(fluid_synth_t* synth, int chan, int param, float value)
 
   fluid_channel_set_gen(synth->channel[chan], param, value, 0);
 
-  for (i = 0; i < synth->polyphony; i++) {
-    voice = synth->voice[i];
+  for (i = 0; i < synth->nactive; i++) {
+    voice = synth->active_voice[i];
     if (voice->chan == chan) {
       fluid_voice_set_param(voice, param, value, 0);
     }
@@ -3347,8 +4532,8 @@ fluid_synth_set_gen2(fluid_synth_t* synth, int chan, int param,
 
   fluid_channel_set_gen(synth->channel[chan], param, v, absolute);
 
-  for (i = 0; i < synth->polyphony; i++) {
-    voice = synth->voice[i];
+  for (i = 0; i < synth->nactive; i++) {
+    voice = synth->active_voice[i];
     if (voice->chan == chan) {
       fluid_voice_set_param(voice, param, v, absolute);
     }
@@ -3412,7 +4597,9 @@ int fluid_synth_start(fluid_synth_t* synth, unsigned int id, fluid_preset_t* pre
   //fluid_mutex_lock(synth->busy); /* One at a time, please */
 
   synth->storeid = id;
+  synth->storesfont = preset->sfont;
   r = fluid_preset_noteon(preset, synth, midi_chan, key, vel);
+  synth->storesfont = NULL;
 
   //fluid_mutex_unlock(synth->busy);
 
@@ -3426,13 +4613,14 @@ int fluid_synth_stop(fluid_synth_t* synth, unsigned int id)
   int status = FLUID_FAILED;
   int count = 0;
 
-  for (i = 0; i < synth->polyphony; i++) {
+  for (i = 0; i < synth->nactive; i++) {
 
-    voice = synth->voice[i];
+    voice = synth->active_voice[i];
 
     if (_ON(voice) && (fluid_voice_get_id(voice) == id)) {
 	    count++;
-      fluid_voice_noteoff(voice);
+      fluid_voice_noteoff_at(voice, fluid_synth_event_offset(synth));
+      fluid_synth_update_steal_heap(synth, voice);
       status = FLUID_OK;
     }
   }
@@ -41,6 +41,7 @@
  *                         DEFINES
  */
 #define FLUID_NUM_PROGRAMS      128
+#define FLUID_PENDING_MODS_WORDS 8       /* 128 general and 128 MIDI controllers */
 #define DRUM_INST_BANK		128
 
 #if defined(WITH_FLOAT)
@@ -78,6 +79,17 @@ struct _fluid_bank_offset_t {
 };
 
 
+typedef struct _fluid_synth_worker_t fluid_synth_worker_t;
+
+/* A thread that helps fluid_synth_one_block() render the voices */
+struct _fluid_synth_worker_t {
+	fluid_synth_t* synth;
+	fluid_thread_t* thread;
+	int index;                       /* its share of the voices, the audio thread's is 0 */
+	fluid_real_t* buf;               /* left and right for each audio group, then reverb and chorus */
+};
+
+
 /*
  * fluid_synth_t
  */
@@ -102,7 +114,9 @@ struct _fluid_synth_t
 
   fluid_list_t *loaders;              /** the soundfont loaders */
   fluid_list_t* sfont;                /** the loaded soundfont */
+  fluid_list_t* sfont_spare;          /** a free node for fluid_synth_swap_sfont() onto an empty stack */
   unsigned int sfont_id;
+  fluid_sfont_t* storesfont;          /** the soundfont of the preset in fluid_synth_start() */
   fluid_list_t* bank_offsets;       /** the offsets of the soundfont banks */
 
 #if defined(MACOS9)
@@ -114,15 +128,38 @@ struct _fluid_synth_t
   int num_channels;                   /** the number of channels */
   int nvoice;                         /** the length of the synthesis process array */
   fluid_voice_t** voice;              /** the synthesis processes */
+  fluid_voice_dsp_t* voice_dsp;       /** the per-block state of voice[i], side by side */
+  fluid_voice_t** active_voice;       /** the voices that may be playing, in the order they were started */
+  int nactive;
+  fluid_voice_t** free_voice;         /** the voices below polyphony that are known to be available */
+  int nfree;
+  fluid_voice_t** key_voices;         /** the active voices by channel and key, midi_channels * 128 lists
+					 linked through the voices */
+  fluid_voice_t** steal_heap;         /** the active voices as a min-heap on steal_prio, for stealing */
+  int nsteal;
+  int steal_heap_valid;               /** cleared when a voice leaves the active list */
+  unsigned int steal_noteid;          /** the noteid the ages in steal_prio are counted from */
   unsigned int noteid;                /** the id is incremented for every new note. it's used for noteoff's  */
   unsigned int storeid;
   int nbuf;                           /** How many audio buffers are used? (depends on nr of audio channels / groups)*/
 
   fluid_real_t** left_buf;
   fluid_real_t** right_buf;
+  fluid_real_t** left_stage;          /** the synth's own left_buf/right_buf, while */
+  fluid_real_t** right_stage;         /** those point into the caller's output */
   fluid_real_t** fx_left_buf;
   fluid_real_t** fx_right_buf;
 
+  int cpu_cores;                      /** the number of threads rendering voices, the caller's included */
+  fluid_synth_worker_t* workers;      /** the cpu_cores - 1 helper threads */
+  fluid_sem_t* workers_start;         /** posted once per worker for every block they help with */
+  fluid_sem_t* workers_done;          /** posted by each worker when its share is rendered */
+  int workers_busy;                   /** the workers still rendering the block, counted down atomically */
+  int workers_quit;
+  fluid_voice_t** jobs;               /** the playing voices of the block, in active list order */
+  int* jobs_group;                    /** the audio group each of them goes to */
+  int num_jobs;
+
   fluid_revmodel_t* reverb;
   fluid_chorus_t* chorus;
   int cur;                           /** the current sample in the audio buffers to be output */
@@ -134,6 +171,12 @@ struct _fluid_synth_t
   fluid_tuning_t* cur_tuning;         /** current tuning in the iteration */
 
   unsigned int min_note_length_ticks; /**< If note-offs are triggered just after a note-on, they will be delayed */
+
+  int coalesce_controllers;           /** hold controller changes back to the start of the next block */
+  unsigned int* pending_mods;         /** the held back controllers, FLUID_PENDING_MODS_WORDS bits per channel */
+  int mods_pending;                   /** set when any bit in pending_mods is */
+
+  int event_offset;                   /** frames into the next block that events take effect at, -1 to follow cur */
 };
 
 /** returns 1 if the value has been set, 0 otherwise */
@@ -21,6 +21,18 @@
 
 #include "fluid_sys.h"
 
+#if defined(WIN32) || defined(_WIN32)
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <sched.h>
+#if defined(__APPLE__)
+#include <dispatch/dispatch.h>
+#else
+#include <semaphore.h>
+#endif
+#endif
+
 static char fluid_errbuf[512];  /* buffer for error message */
 
 static fluid_log_function_t fluid_log_function[LAST_LOG_LEVEL];
@@ -352,7 +364,253 @@ fluid_is_soundfont(char* filename)
  *
  */
 
-//thread disabled
+#if defined(WIN32) || defined(_WIN32)
+
+struct _fluid_thread_t {
+  HANDLE handle;
+  fluid_thread_func_t func;
+  void* data;
+};
+
+struct _fluid_sem_t {
+  HANDLE handle;
+};
+
+static DWORD WINAPI
+fluid_thread_start(LPVOID data)
+{
+  fluid_thread_t* thread = (fluid_thread_t*) data;
+  thread->func(thread->data);
+  return 0;
+}
+
+fluid_thread_t*
+new_fluid_thread(fluid_thread_func_t func, void* data, int realtime)
+{
+  fluid_thread_t* thread;
+
+  thread = FLUID_NEW(fluid_thread_t);
+  if (thread == NULL) {
+    FLUID_LOG(FLUID_ERR, "Out of memory");
+    return NULL;
+  }
+
+  thread->func = func;
+  thread->data = data;
+  thread->handle = CreateThread(NULL, 0, fluid_thread_start, thread, 0, NULL);
+
+  if (thread->handle == NULL) {
+    FLUID_LOG(FLUID_ERR, "Failed to create the thread");
+    FLUID_FREE(thread);
+    return NULL;
+  }
+
+  if (realtime) {
+    SetThreadPriority(thread->handle, THREAD_PRIORITY_TIME_CRITICAL);
+  }
+
+  return thread;
+}
+
+int
+fluid_thread_join(fluid_thread_t* thread)
+{
+  if (WaitForSingleObject(thread->handle, INFINITE) != WAIT_OBJECT_0) {
+    return FLUID_FAILED;
+  }
+  return FLUID_OK;
+}
+
+void
+delete_fluid_thread(fluid_thread_t* thread)
+{
+  CloseHandle(thread->handle);
+  FLUID_FREE(thread);
+}
+
+fluid_sem_t*
+new_fluid_sem(void)
+{
+  fluid_sem_t* sem;
+
+  sem = FLUID_NEW(fluid_sem_t);
+  if (sem == NULL) {
+    FLUID_LOG(FLUID_ERR, "Out of memory");
+    return NULL;
+  }
+
+  sem->handle = CreateSemaphore(NULL, 0, 0x7fffffff, NULL);
+  if (sem->handle == NULL) {
+    FLUID_LOG(FLUID_ERR, "Failed to create the semaphore");
+    FLUID_FREE(sem);
+    return NULL;
+  }
+
+  return sem;
+}
+
+void
+delete_fluid_sem(fluid_sem_t* sem)
+{
+  CloseHandle(sem->handle);
+  FLUID_FREE(sem);
+}
+
+void
+fluid_sem_post(fluid_sem_t* sem, int count)
+{
+  ReleaseSemaphore(sem->handle, count, NULL);
+}
+
+void
+fluid_sem_wait(fluid_sem_t* sem)
+{
+  WaitForSingleObject(sem->handle, INFINITE);
+}
+
+#else
+
+struct _fluid_thread_t {
+  pthread_t pthread;
+  fluid_thread_func_t func;
+  void* data;
+};
+
+/* Unnamed POSIX semaphores aren't available on OS X, which has
+   dispatch semaphores instead. Neither takes a lock when posting, or
+   when waiting on a count that is already there. */
+struct _fluid_sem_t {
+#if defined(__APPLE__)
+  dispatch_semaphore_t sem;
+#else
+  sem_t sem;
+#endif
+};
+
+static void*
+fluid_thread_start(void* data)
+{
+  fluid_thread_t* thread = (fluid_thread_t*) data;
+  thread->func(thread->data);
+  return NULL;
+}
+
+fluid_thread_t*
+new_fluid_thread(fluid_thread_func_t func, void* data, int realtime)
+{
+  fluid_thread_t* thread;
+  pthread_attr_t attr;
+  struct sched_param param;
+  int err = -1;
+
+  thread = FLUID_NEW(fluid_thread_t);
+  if (thread == NULL) {
+    FLUID_LOG(FLUID_ERR, "Out of memory");
+    return NULL;
+  }
+
+  thread->func = func;
+  thread->data = data;
+
+  if (realtime) {
+    pthread_attr_init(&attr);
+    pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+    pthread_attr_setschedpolicy(&attr, SCHED_FIFO);
+    param.sched_priority = (sched_get_priority_min(SCHED_FIFO) + sched_get_priority_max(SCHED_FIFO)) / 2;
+    pthread_attr_setschedparam(&attr, &param);
+    err = pthread_create(&thread->pthread, &attr, fluid_thread_start, thread);
+    pthread_attr_destroy(&attr);
+
+    if (err != 0) {
+      FLUID_LOG(FLUID_WARN, "Couldn't create a realtime thread, using a normal one");
+    }
+  }
+
+  if ((err != 0) && (pthread_create(&thread->pthread, NULL, fluid_thread_start, thread) != 0)) {
+    FLUID_LOG(FLUID_ERR, "Failed to create the thread");
+    FLUID_FREE(thread);
+    return NULL;
+  }
+
+  return thread;
+}
+
+int
+fluid_thread_join(fluid_thread_t* thread)
+{
+  if (pthread_join(thread->pthread, NULL) != 0) {
+    return FLUID_FAILED;
+  }
+  return FLUID_OK;
+}
+
+void
+delete_fluid_thread(fluid_thread_t* thread)
+{
+  FLUID_FREE(thread);
+}
+
+fluid_sem_t*
+new_fluid_sem(void)
+{
+  fluid_sem_t* sem;
+
+  sem = FLUID_NEW(fluid_sem_t);
+  if (sem == NULL) {
+    FLUID_LOG(FLUID_ERR, "Out of memory");
+    return NULL;
+  }
+
+#if defined(__APPLE__)
+  sem->sem = dispatch_semaphore_create(0);
+  if (sem->sem == NULL) {
+#else
+  if (sem_init(&sem->sem, 0, 0) != 0) {
+#endif
+    FLUID_LOG(FLUID_ERR, "Failed to create the semaphore");
+    FLUID_FREE(sem);
+    return NULL;
+  }
+
+  return sem;
+}
+
+void
+delete_fluid_sem(fluid_sem_t* sem)
+{
+#if defined(__APPLE__)
+  dispatch_release(sem->sem);
+#else
+  sem_destroy(&sem->sem);
+#endif
+  FLUID_FREE(sem);
+}
+
+void
+fluid_sem_post(fluid_sem_t* sem, int count)
+{
+  while (count-- > 0) {
+#if defined(__APPLE__)
+    dispatch_semaphore_signal(sem->sem);
+#else
+    sem_post(&sem->sem);
+#endif
+  }
+}
+
+void
+fluid_sem_wait(fluid_sem_t* sem)
+{
+#if defined(__APPLE__)
+  dispatch_semaphore_wait(sem->sem, DISPATCH_TIME_FOREVER);
+#else
+  /* sem_wait() returns early if a signal interrupts it */
+  while (sem_wait(&sem->sem) != 0) {
+  }
+#endif
+}
+
+#endif
 
 
 /***************************************************************
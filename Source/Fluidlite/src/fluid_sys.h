@@ -85,6 +85,23 @@ int fluid_debug(int level, char * fmt, ...);
 
 */
 
+typedef struct _fluid_thread_t fluid_thread_t;
+typedef void (*fluid_thread_func_t)(void* data);
+
+/* With realtime set, the thread asks for realtime scheduling and
+   falls back to a normal thread if the system refuses. */
+fluid_thread_t* new_fluid_thread(fluid_thread_func_t func, void* data, int realtime);
+int fluid_thread_join(fluid_thread_t* thread);
+void delete_fluid_thread(fluid_thread_t* thread);
+
+/* Counting semaphore */
+typedef struct _fluid_sem_t fluid_sem_t;
+
+fluid_sem_t* new_fluid_sem(void);
+void delete_fluid_sem(fluid_sem_t* sem);
+void fluid_sem_post(fluid_sem_t* sem, int count);
+void fluid_sem_wait(fluid_sem_t* sem);
+
 
 /**
      Sockets
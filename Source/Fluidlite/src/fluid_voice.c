@@ -45,17 +45,11 @@
 /* min vol envelope release (to stop clicks) in SoundFont timecents */
 #define FLUID_MIN_VOLENVRELEASE -7200.0f /* ~16ms */
 
-//removed inline
-static void fluid_voice_effects (fluid_voice_t *voice, int count,
-				        fluid_real_t* dsp_left_buf,
-				        fluid_real_t* dsp_right_buf,
-				        fluid_real_t* dsp_reverb_buf,
-				        fluid_real_t* dsp_chorus_buf);
 /*
  * new_fluid_voice
  */
 fluid_voice_t*
-new_fluid_voice(fluid_real_t output_rate)
+new_fluid_voice(fluid_real_t output_rate, fluid_voice_dsp_t* dsp)
 {
   fluid_voice_t* voice;
   voice = FLUID_NEW(fluid_voice_t);
@@ -68,8 +62,15 @@ new_fluid_voice(fluid_real_t output_rate)
   voice->key = 0;
   voice->vel = 0;
   voice->channel = NULL;
+  voice->key_next = NULL;
+  voice->key_prevp = NULL;
+  voice->steal_index = -1;
+  voice->sfont = NULL;
   voice->sample = NULL;
+  voice->link_sample = NULL;
+  voice->link_data = NULL;
   voice->output_rate = output_rate;
+  voice->dsp = dsp;
 
   /* The 'sustain' and 'finished' segments of the volume / modulation
    * envelope are constant. They are never affected by any modulator
@@ -138,6 +139,8 @@ fluid_voice_init(fluid_voice_t* voice, fluid_sample_t* sample,
   voice->channel = channel;
   voice->mod_count = 0;
   voice->sample = sample;
+  voice->link_sample = NULL;
+  voice->link_data = NULL;
   voice->start_time = start_time;
   voice->ticks = 0;
   voice->noteoff_ticks = 0;
@@ -148,29 +151,37 @@ fluid_voice_init(fluid_voice_t* voice, fluid_sample_t* sample,
   voice->interp_method = fluid_channel_get_interp_method(voice->channel);
 
   /* vol env initialization */
-  voice->volenv_count = 0;
-  voice->volenv_section = 0;
-  voice->volenv_val = 0.0f;
-  voice->amp = 0.0f; /* The last value of the volume envelope, used to
+  voice->dsp->volenv_count = 0;
+  voice->dsp->volenv_section = 0;
+  voice->dsp->volenv_val = 0.0f;
+  voice->dsp->amp = 0.0f; /* The last value of the volume envelope, used to
                         calculate the volume increment during
                         processing */
 
   /* mod env initialization*/
-  voice->modenv_count = 0;
-  voice->modenv_section = 0;
-  voice->modenv_val = 0.0f;
+  voice->dsp->modenv_count = 0;
+  voice->dsp->modenv_section = 0;
+  voice->dsp->modenv_val = 0.0f;
 
   /* mod lfo */
-  voice->modlfo_val = 0.0;/* Fixme: Retrieve from any other existing
+  voice->dsp->modlfo_val = 0.0;/* Fixme: Retrieve from any other existing
                              voice on this channel to keep LFOs in
                              unison? */
 
   /* vib lfo */
-  voice->viblfo_val = 0.0f; /* Fixme: See mod lfo */
+  voice->dsp->viblfo_val = 0.0f; /* Fixme: See mod lfo */
 
   /* Clear sample history in filter */
-  voice->hist1 = 0;
-  voice->hist2 = 0;
+  voice->dsp->hist1 = 0;
+  voice->dsp->hist2 = 0;
+  voice->dsp->link_hist1 = 0;
+  voice->dsp->link_hist2 = 0;
+  voice->dsp->start_offset = 0;
+  voice->dsp->stop_offset = -1;
+  voice->dsp->release_offset = -1;
+  voice->dsp->buf_start = 0;
+  voice->dsp->buf_end = FLUID_BUFSIZE;
+  voice->dsp->ramp_start = 0;
 
   /* Set all the generators to their default value, according to SF
    * 2.01 section 8.1.3 (page 48). The value of NRPN messages are
@@ -201,6 +212,49 @@ fluid_voice_init(fluid_voice_t* voice, fluid_sample_t* sample,
   return FLUID_OK;
 }
 
+/*
+ * fluid_voice_set_link
+ *
+ * Has the voice play sample as well, as the second channel of a
+ * stereo pair, between fluid_voice_init() and the start of the note.
+ * The zones of the two samples must differ in nothing but their pan,
+ * which is pan for this one. The samples must share their data and
+ * their start, end and loop points relative to the start, so that the
+ * voice can step through both with the same indices; sample may not
+ * lie before the voice's own sample in the data.
+ */
+int
+fluid_voice_set_link(fluid_voice_t* voice, fluid_sample_t* sample, fluid_real_t pan)
+{
+  if ((voice->sample == NULL) || (sample->data != voice->sample->data)
+      || (sample->start < voice->sample->start)) {
+    return FLUID_FAILED;
+  }
+
+  voice->link_sample = sample;
+  voice->link_data = sample->data + (sample->start - voice->sample->start);
+  voice->link_pan = pan;
+
+  /* Held for the same reason as the voice's own sample */
+  fluid_sample_incr_ref(voice->link_sample);
+
+  return FLUID_OK;
+}
+
+/* The pan of the second channel of a stereo voice */
+static void
+fluid_voice_update_link_pan(fluid_voice_t* voice)
+{
+  fluid_real_t pan;
+
+  if (voice->link_sample == NULL) return;
+
+  pan = voice->link_pan + (fluid_real_t)voice->gen[GEN_PAN].mod
+    + (fluid_real_t)voice->gen[GEN_PAN].nrpn;
+  voice->dsp->link_amp_left = fluid_pan(pan, 1) * voice->synth_gain / 32768.0f;
+  voice->dsp->link_amp_right = fluid_pan(pan, 0) * voice->synth_gain / 32768.0f;
+}
+
 void fluid_voice_gen_set(fluid_voice_t* voice, int i, float val)
 {
   voice->gen[i].val = val;
@@ -232,45 +286,111 @@ fluid_real_t fluid_voice_gen_value(fluid_voice_t* voice, int num)
 
 
 /*
- * fluid_voice_write
+ * fluid_voice_update_control
  *
- * This is where it all happens. This function is called by the
- * synthesizer to generate the sound samples. The synthesizer passes
- * four audio buffers: left, right, reverb out, and chorus out.
+ * The control rate half of rendering a block. The synthesizer calls
+ * this for all its playing voices before any of them is rendered
+ * with fluid_voice_write().
  *
- * The biggest part of this function sets the correct values for all
+ * It steps the envelopes and LFOs and sets the correct values for all
  * the dsp parameters (all the control data boil down to only a few
- * dsp parameters). The dsp routine is #included in several places (fluid_dsp_core.c).
+ * dsp parameters), except for the filter coefficients: when the
+ * filter frequency has moved, it returns 1 and puts the new
+ * frequency, in radians per sample, in omega. The synthesizer then
+ * works out sin and cos of omega for a batch of voices at once and
+ * hands them to fluid_voice_update_filter(). Returns 0 otherwise.
  */
 int
-fluid_voice_write(fluid_voice_t* voice,
-		 fluid_real_t* dsp_left_buf, fluid_real_t* dsp_right_buf,
-		 fluid_real_t* dsp_reverb_buf, fluid_real_t* dsp_chorus_buf)
+fluid_voice_update_control(fluid_voice_t* voice, fluid_real_t* omega)
 {
   fluid_real_t fres;
   fluid_real_t target_amp;	/* target amplitude */
-  int count;
-
-//  int dsp_interp_method = voice->interp_method;
-
-  fluid_real_t dsp_buf[FLUID_BUFSIZE];
   fluid_env_data_t* env_data;
   fluid_real_t x;
 
+  voice->dsp->render = 0;
 
   /* make sure we're playing and that we have sample data */
-  if (!_PLAYING(voice)) return FLUID_OK;
+  if (!_PLAYING(voice)) return 0;
 
   /******************* sample **********************/
 
   if (voice->sample == NULL)
   {
     fluid_voice_off(voice);
-    return FLUID_OK;
+    return 0;
+  }
+
+  /******************* sub-block timing **********************/
+
+  /* All the offsets count from the start of this block. A voice that
+   * hasn't reached its start yet sits the block out without aging. */
+  if (voice->dsp->stop_offset == 0)
+  {
+    fluid_voice_off(voice);
+    return 0;
+  }
+
+  if (voice->dsp->start_offset >= FLUID_BUFSIZE)
+  {
+    voice->dsp->start_offset -= FLUID_BUFSIZE;
+    if (voice->dsp->stop_offset > 0)
+      voice->dsp->stop_offset = (voice->dsp->stop_offset > FLUID_BUFSIZE)
+	? voice->dsp->stop_offset - FLUID_BUFSIZE : 0;
+    if (voice->dsp->release_offset > 0)
+      voice->dsp->release_offset = (voice->dsp->release_offset > FLUID_BUFSIZE)
+	? voice->dsp->release_offset - FLUID_BUFSIZE : 0;
+    return 0;
+  }
+
+  voice->dsp->buf_start = voice->dsp->start_offset;
+  voice->dsp->buf_end = FLUID_BUFSIZE;
+  voice->dsp->start_offset = 0;
+
+  /* A stop inside the block cuts it short, and fluid_voice_write()
+   * turns the voice off after it. One on the block end is done at the
+   * start of the next. */
+  if (voice->dsp->stop_offset > 0)
+  {
+    if (voice->dsp->stop_offset <= FLUID_BUFSIZE)
+    {
+      voice->dsp->buf_end = voice->dsp->stop_offset;
+      voice->dsp->stop_offset = 0;
+    }
+    else voice->dsp->stop_offset -= FLUID_BUFSIZE;
+  }
+
+  if (voice->dsp->buf_end <= voice->dsp->buf_start)
+  {
+    fluid_voice_off(voice);
+    return 0;
+  }
+
+  /* A release inside the block goes into the envelopes now, and the
+   * amplitude holds until its frame, from where it ramps towards the
+   * release (see fluid_voice_write()). */
+  voice->dsp->ramp_start = voice->dsp->buf_start;
+
+  if (voice->dsp->release_offset >= 0)
+  {
+    if (voice->dsp->release_offset < FLUID_BUFSIZE)
+    {
+      if ((voice->dsp->release_offset > voice->dsp->buf_start)
+	  && (voice->dsp->release_offset < voice->dsp->buf_end))
+	voice->dsp->ramp_start = voice->dsp->release_offset;
+      voice->dsp->release_offset = -1;
+      fluid_voice_noteoff(voice);
+
+      /* held back by the minimum note length */
+      if (voice->dsp->volenv_section != FLUID_VOICE_ENVRELEASE)
+	voice->dsp->ramp_start = voice->dsp->buf_start;
+    }
+    else voice->dsp->release_offset -= FLUID_BUFSIZE;
   }
 
   if (voice->noteoff_ticks != 0 && voice->ticks >= voice->noteoff_ticks)
   {
+    voice->noteoff_ticks = 0;
     fluid_voice_noteoff(voice);
   }
 
@@ -280,106 +400,106 @@ fluid_voice_write(fluid_voice_t* voice,
 
   /******************* vol env **********************/
 
-  env_data = &voice->volenv_data[voice->volenv_section];
+  env_data = &voice->volenv_data[voice->dsp->volenv_section];
 
   /* skip to the next section of the envelope if necessary */
-  while (voice->volenv_count >= env_data->count)
+  while (voice->dsp->volenv_count >= env_data->count)
   {
     // If we're switching envelope stages from decay to sustain, force the value to be the end value of the previous stage
-    if (env_data && voice->volenv_section == FLUID_VOICE_ENVDECAY)
-      voice->volenv_val = env_data->min * env_data->coeff;
+    if (env_data && voice->dsp->volenv_section == FLUID_VOICE_ENVDECAY)
+      voice->dsp->volenv_val = env_data->min * env_data->coeff;
 
-    env_data = &voice->volenv_data[++voice->volenv_section];
-    voice->volenv_count = 0;
+    env_data = &voice->volenv_data[++voice->dsp->volenv_section];
+    voice->dsp->volenv_count = 0;
   }
 
   /* calculate the envelope value and check for valid range */
-  x = env_data->coeff * voice->volenv_val + env_data->incr;
+  x = env_data->coeff * voice->dsp->volenv_val + env_data->incr;
   if (x < env_data->min)
   {
     x = env_data->min;
-    voice->volenv_section++;
-    voice->volenv_count = 0;
+    voice->dsp->volenv_section++;
+    voice->dsp->volenv_count = 0;
   }
   else if (x > env_data->max)
   {
     x = env_data->max;
-    voice->volenv_section++;
-    voice->volenv_count = 0;
+    voice->dsp->volenv_section++;
+    voice->dsp->volenv_count = 0;
   }
 
-  voice->volenv_val = x;
-  voice->volenv_count++;
+  voice->dsp->volenv_val = x;
+  voice->dsp->volenv_count++;
 
-  if (voice->volenv_section == FLUID_VOICE_ENVFINISHED)
+  if (voice->dsp->volenv_section == FLUID_VOICE_ENVFINISHED)
   {
     fluid_voice_off (voice);
-    return FLUID_OK;
+    return 0;
   }
 
   /******************* mod env **********************/
 
-  env_data = &voice->modenv_data[voice->modenv_section];
+  env_data = &voice->modenv_data[voice->dsp->modenv_section];
 
   /* skip to the next section of the envelope if necessary */
-  while (voice->modenv_count >= env_data->count)
+  while (voice->dsp->modenv_count >= env_data->count)
   {
-    env_data = &voice->modenv_data[++voice->modenv_section];
-    voice->modenv_count = 0;
+    env_data = &voice->modenv_data[++voice->dsp->modenv_section];
+    voice->dsp->modenv_count = 0;
   }
 
   /* calculate the envelope value and check for valid range */
-  x = env_data->coeff * voice->modenv_val + env_data->incr;
+  x = env_data->coeff * voice->dsp->modenv_val + env_data->incr;
 
   if (x < env_data->min)
   {
     x = env_data->min;
-    voice->modenv_section++;
-    voice->modenv_count = 0;
+    voice->dsp->modenv_section++;
+    voice->dsp->modenv_count = 0;
   }
   else if (x > env_data->max)
   {
     x = env_data->max;
-    voice->modenv_section++;
-    voice->modenv_count = 0;
+    voice->dsp->modenv_section++;
+    voice->dsp->modenv_count = 0;
   }
 
-  voice->modenv_val = x;
-  voice->modenv_count++;
+  voice->dsp->modenv_val = x;
+  voice->dsp->modenv_count++;
 
   /******************* mod lfo **********************/
 
-  if (voice->ticks >= voice->modlfo_delay)
+  if (voice->ticks >= voice->dsp->modlfo_delay)
   {
-    voice->modlfo_val += voice->modlfo_incr;
+    voice->dsp->modlfo_val += voice->dsp->modlfo_incr;
   
-    if (voice->modlfo_val > 1.0)
+    if (voice->dsp->modlfo_val > 1.0)
     {
-      voice->modlfo_incr = -voice->modlfo_incr;
-      voice->modlfo_val = (fluid_real_t) 2.0 - voice->modlfo_val;
+      voice->dsp->modlfo_incr = -voice->dsp->modlfo_incr;
+      voice->dsp->modlfo_val = (fluid_real_t) 2.0 - voice->dsp->modlfo_val;
     }
-    else if (voice->modlfo_val < -1.0)
+    else if (voice->dsp->modlfo_val < -1.0)
     {
-      voice->modlfo_incr = -voice->modlfo_incr;
-      voice->modlfo_val = (fluid_real_t) -2.0 - voice->modlfo_val;
+      voice->dsp->modlfo_incr = -voice->dsp->modlfo_incr;
+      voice->dsp->modlfo_val = (fluid_real_t) -2.0 - voice->dsp->modlfo_val;
     }
   }
 
   /******************* vib lfo **********************/
 
-  if (voice->ticks >= voice->viblfo_delay)
+  if (voice->ticks >= voice->dsp->viblfo_delay)
   {
-    voice->viblfo_val += voice->viblfo_incr;
+    voice->dsp->viblfo_val += voice->dsp->viblfo_incr;
 
-    if (voice->viblfo_val > (fluid_real_t) 1.0)
+    if (voice->dsp->viblfo_val > (fluid_real_t) 1.0)
     {
-      voice->viblfo_incr = -voice->viblfo_incr;
-      voice->viblfo_val = (fluid_real_t) 2.0 - voice->viblfo_val;
+      voice->dsp->viblfo_incr = -voice->dsp->viblfo_incr;
+      voice->dsp->viblfo_val = (fluid_real_t) 2.0 - voice->dsp->viblfo_val;
     }
-    else if (voice->viblfo_val < -1.0)
+    else if (voice->dsp->viblfo_val < -1.0)
     {
-      voice->viblfo_incr = -voice->viblfo_incr;
-      voice->viblfo_val = (fluid_real_t) -2.0 - voice->viblfo_val;
+      voice->dsp->viblfo_incr = -voice->dsp->viblfo_incr;
+      voice->dsp->viblfo_val = (fluid_real_t) -2.0 - voice->dsp->viblfo_val;
     }
   }
 
@@ -390,17 +510,19 @@ fluid_voice_write(fluid_voice_t* voice,
    * - amplitude envelope
    */
 
-  if (voice->volenv_section == FLUID_VOICE_ENVDELAY)
-    goto post_process;	/* The volume amplitude is in hold phase. No sound is produced. */
+  voice->ticks += FLUID_BUFSIZE;
+
+  if (voice->dsp->volenv_section == FLUID_VOICE_ENVDELAY)
+    return 0;	/* The volume amplitude is in hold phase. No sound is produced. */
 
-  if (voice->volenv_section == FLUID_VOICE_ENVATTACK)
+  if (voice->dsp->volenv_section == FLUID_VOICE_ENVATTACK)
   {
     /* the envelope is in the attack section: ramp linearly to max value.
      * A positive modlfo_to_vol should increase volume (negative attenuation).
      */
     target_amp = fluid_atten2amp (voice->attenuation)
-      * fluid_cb2amp (voice->modlfo_val * -voice->modlfo_to_vol)
-      * voice->volenv_val;
+      * fluid_cb2amp (voice->dsp->modlfo_val * -voice->modlfo_to_vol)
+      * voice->dsp->volenv_val;
   }
   else
   {
@@ -408,8 +530,8 @@ fluid_voice_write(fluid_voice_t* voice,
     fluid_real_t amp_max;
 
     target_amp = fluid_atten2amp (voice->attenuation)
-      * fluid_cb2amp (960.0f * (1.0f - voice->volenv_val)
-		      + voice->modlfo_val * -voice->modlfo_to_vol);
+      * fluid_cb2amp (960.0f * (1.0f - voice->dsp->volenv_val)
+		      + voice->dsp->modlfo_val * -voice->modlfo_to_vol);
 
     /* We turn off a voice, if the volume has dropped low enough. */
 
@@ -434,7 +556,7 @@ fluid_voice_write(fluid_voice_t* voice,
      * volenv_val can only drop):
      */
 
-    amp_max = fluid_atten2amp (voice->min_attenuation_cB) * voice->volenv_val;
+    amp_max = fluid_atten2amp (voice->min_attenuation_cB) * voice->dsp->volenv_val;
 
     /* And if amp_max is already smaller than the known amplitude,
      * which will attenuate the sample below the noise floor, then we
@@ -442,35 +564,38 @@ fluid_voice_write(fluid_voice_t* voice,
     if (amp_max < amplitude_that_reaches_noise_floor)
     {
       fluid_voice_off (voice);
-      goto post_process;
+      return 0;
     }
   }
 
-  /* Volume increment to go from voice->amp to target_amp in FLUID_BUFSIZE steps */
-  voice->amp_incr = (target_amp - voice->amp) / FLUID_BUFSIZE;
+  /* Volume increment to go from voice->dsp->amp to target_amp over the
+   * frames of the block the voice plays, from the release if there is one */
+  voice->dsp->amp_incr = (target_amp - voice->dsp->amp) / (voice->dsp->buf_end - voice->dsp->ramp_start);
 
   /* no volume and not changing? - No need to process */
-  if ((voice->amp == 0.0f) && (voice->amp_incr == 0.0f))
-    goto post_process;
+  if ((voice->dsp->amp == 0.0f) && (voice->dsp->amp_incr == 0.0f))
+    return 0;
+
+  voice->dsp->render = 1;
 
   /* Calculate the number of samples, that the DSP loop advances
    * through the original waveform with each step in the output
    * buffer. It is the ratio between the frequencies of original
    * waveform and output waveform.*/
-  voice->phase_incr = fluid_ct2hz_real
-    (voice->pitch + voice->modlfo_val * voice->modlfo_to_pitch
-     + voice->viblfo_val * voice->viblfo_to_pitch
-     + voice->modenv_val * voice->modenv_to_pitch) / voice->root_pitch;
+  voice->dsp->phase_incr = fluid_ct2hz_real
+    (voice->pitch + voice->dsp->modlfo_val * voice->modlfo_to_pitch
+     + voice->dsp->viblfo_val * voice->viblfo_to_pitch
+     + voice->dsp->modenv_val * voice->modenv_to_pitch) / voice->root_pitch;
 
   /* if phase_incr is not advancing, set it to the minimum fraction value (prevent stuckage) */
-  if (voice->phase_incr == 0) voice->phase_incr = 1;
+  if (voice->dsp->phase_incr == 0) voice->dsp->phase_incr = 1;
 
   /*************** resonant filter ******************/
 
   /* calculate the frequency of the resonant filter in Hz */
   fres = fluid_ct2hz(voice->fres
-		     + voice->modlfo_val * voice->modlfo_to_fc
-		     + voice->modenv_val * voice->modenv_to_fc);
+		     + voice->dsp->modlfo_val * voice->modlfo_to_fc
+		     + voice->dsp->modenv_val * voice->modenv_to_fc);
 
   /* FIXME - Still potential for a click during turn on, can we interpolate
      between 20khz cutoff and 0 Q? */
@@ -491,271 +616,182 @@ fluid_voice_write(fluid_voice_t* voice,
     fres = 5;
 
   /* if filter enabled and there is a significant frequency change.. */
-    if ((fabsf (fres - voice->last_fres) > 0.01))
+  if ((fabsf (fres - voice->last_fres) > 0.01))
   {
     /* The filter coefficients have to be recalculated (filter
     * parameters have changed). Recalculation for various reasons is
     * forced by setting last_fres to -1.  The flag filter_startup
     * indicates, that the DSP loop runs for the first time, in this
     * case, the filter is set directly, instead of smoothly fading
-    * between old and new settings.
-    *
-    * Those equations from Robert Bristow-Johnson's `Cookbook
-    * formulae for audio EQ biquad filter coefficients', obtained
-    * from Harmony-central.com / Computer / Programming. They are
-    * the result of the bilinear transform on an analogue filter
-    * prototype. To quote, `BLT frequency warping has been taken
-    * into account for both significant frequency relocation and for
-    * bandwidth readjustment'. */
-
-   fluid_real_t omega = (fluid_real_t) (2.0 * M_PI * (fres / ((float) voice->output_rate)));
-   fluid_real_t sin_coeff = (fluid_real_t) sin(omega);
-   fluid_real_t cos_coeff = (fluid_real_t) cos(omega);
-   fluid_real_t alpha_coeff = sin_coeff / (2.0f * voice->q_lin);
-   fluid_real_t a0_inv = 1.0f / (1.0f + alpha_coeff);
-
-   /* Calculate the filter coefficients. All coefficients are
-    * normalized by a0. Think of `a1' as `a1/a0'.
-    *
-    * Here a couple of multiplications are saved by reusing common expressions.
-    * The original equations should be:
-    *  voice->b0=(1.-cos_coeff)*a0_inv*0.5*voice->filter_gain;
-    *  voice->b1=(1.-cos_coeff)*a0_inv*voice->filter_gain;
-    *  voice->b2=(1.-cos_coeff)*a0_inv*0.5*voice->filter_gain; */
-
-   fluid_real_t a1_temp = -2.0f * cos_coeff * a0_inv;
-   fluid_real_t a2_temp = (1.0f - alpha_coeff) * a0_inv;
-   fluid_real_t b1_temp = (1.0f - cos_coeff) * a0_inv * voice->filter_gain;
-   /* both b0 -and- b2 */
-   fluid_real_t b02_temp = b1_temp * 0.5f;
-
-   if (voice->filter_startup)
-   {
-     /* The filter is calculated, because the voice was started up.
-      * In this case set the filter coefficients without delay.
-      */
-     voice->a1 = a1_temp;
-     voice->a2 = a2_temp;
-     voice->b02 = b02_temp;
-     voice->b1 = b1_temp;
-     voice->filter_coeff_incr_count = 0;
-     voice->filter_startup = 0;
-//       printf("Setting initial filter coefficients.\n");
-   }
-   else
-   {
-
-      /* The filter frequency is changed.  Calculate an increment
-       * factor, so that the new setting is reached after one buffer
-       * length. x_incr is added to the current value FLUID_BUFSIZE
-       * times. The length is arbitrarily chosen. Longer than one
-       * buffer will sacrifice some performance, though.  Note: If
-       * the filter is still too 'grainy', then increase this number
-       * at will.
-       */
-
-#define FILTER_TRANSITION_SAMPLES (FLUID_BUFSIZE)
+    * between old and new settings. */
 
-      voice->a1_incr = (a1_temp - voice->a1) / FILTER_TRANSITION_SAMPLES;
-      voice->a2_incr = (a2_temp - voice->a2) / FILTER_TRANSITION_SAMPLES;
-      voice->b02_incr = (b02_temp - voice->b02) / FILTER_TRANSITION_SAMPLES;
-      voice->b1_incr = (b1_temp - voice->b1) / FILTER_TRANSITION_SAMPLES;
-      /* Have to add the increments filter_coeff_incr_count times. */
-      voice->filter_coeff_incr_count = FILTER_TRANSITION_SAMPLES;
-    }
-    voice->last_fres = fres;
+    voice->next_fres = fres;
+    *omega = (fluid_real_t) (2.0 * M_PI * (fres / ((float) voice->output_rate)));
+    return 1;
   }
 
+  return 0;
+}
 
-  /*********************** run the dsp chain ************************
-   * The sample is mixed with the output buffer.
-   * The buffer has to be filled from 0 to FLUID_BUFSIZE-1.
-   * Depending on the position in the loop and the loop size, this
-   * may require several runs. */
+/*
+ * fluid_voice_update_filter
+ *
+ * Sets the filter to the frequency fluid_voice_update_control() asked
+ * for. sin_coeff and cos_coeff are the sine and cosine of the omega
+ * it returned.
+ */
+void
+fluid_voice_update_filter(fluid_voice_t* voice, fluid_real_t sin_coeff, fluid_real_t cos_coeff)
+{
+  /* Those equations from Robert Bristow-Johnson's `Cookbook
+   * formulae for audio EQ biquad filter coefficients', obtained
+   * from Harmony-central.com / Computer / Programming. They are
+   * the result of the bilinear transform on an analogue filter
+   * prototype. To quote, `BLT frequency warping has been taken
+   * into account for both significant frequency relocation and for
+   * bandwidth readjustment'. */
+
+  fluid_real_t alpha_coeff = sin_coeff / (2.0f * voice->q_lin);
+  fluid_real_t a0_inv = 1.0f / (1.0f + alpha_coeff);
+
+  /* Calculate the filter coefficients. All coefficients are
+   * normalized by a0. Think of `a1' as `a1/a0'.
+   *
+   * Here a couple of multiplications are saved by reusing common expressions.
+   * The original equations should be:
+   *  voice->b0=(1.-cos_coeff)*a0_inv*0.5*voice->filter_gain;
+   *  voice->b1=(1.-cos_coeff)*a0_inv*voice->filter_gain;
+   *  voice->b2=(1.-cos_coeff)*a0_inv*0.5*voice->filter_gain; */
+
+  fluid_real_t a1_temp = -2.0f * cos_coeff * a0_inv;
+  fluid_real_t a2_temp = (1.0f - alpha_coeff) * a0_inv;
+  fluid_real_t b1_temp = (1.0f - cos_coeff) * a0_inv * voice->filter_gain;
+  /* both b0 -and- b2 */
+  fluid_real_t b02_temp = b1_temp * 0.5f;
+
+  if (voice->filter_startup)
+  {
+    /* The filter is calculated, because the voice was started up.
+     * In this case set the filter coefficients without delay.
+     */
+    voice->dsp->a1 = a1_temp;
+    voice->dsp->a2 = a2_temp;
+    voice->dsp->b02 = b02_temp;
+    voice->dsp->b1 = b1_temp;
+    voice->dsp->filter_coeff_incr_count = 0;
+    voice->filter_startup = 0;
+  }
+  else
+  {
+    /* The filter frequency is changed.  Calculate an increment
+     * factor, so that the new setting is reached after one buffer
+     * length. x_incr is added to the current value FLUID_BUFSIZE
+     * times. The length is arbitrarily chosen. Longer than one
+     * buffer will sacrifice some performance, though.  Note: If
+     * the filter is still too 'grainy', then increase this number
+     * at will.
+     */
+
+#define FILTER_TRANSITION_SAMPLES (FLUID_BUFSIZE)
 
-  voice->dsp_buf = dsp_buf;
+    voice->dsp->a1_incr = (a1_temp - voice->dsp->a1) / FILTER_TRANSITION_SAMPLES;
+    voice->dsp->a2_incr = (a2_temp - voice->dsp->a2) / FILTER_TRANSITION_SAMPLES;
+    voice->dsp->b02_incr = (b02_temp - voice->dsp->b02) / FILTER_TRANSITION_SAMPLES;
+    voice->dsp->b1_incr = (b1_temp - voice->dsp->b1) / FILTER_TRANSITION_SAMPLES;
+    /* Have to add the increments filter_coeff_incr_count times. */
+    voice->dsp->filter_coeff_incr_count = FILTER_TRANSITION_SAMPLES;
+  }
+  voice->last_fres = voice->next_fres;
+}
 
+/*
+ * fluid_voice_interpolate
+ *
+ * Runs the voice's interpolator, filter, pan and sends over the
+ * frames from buf_start to buf_end. Returns the frame it got to,
+ * which is less than buf_end if the sample ended.
+ */
+static int
+fluid_voice_interpolate(fluid_voice_t* voice,
+			fluid_real_t* dsp_left_buf, fluid_real_t* dsp_right_buf,
+			fluid_real_t* dsp_reverb_buf, fluid_real_t* dsp_chorus_buf)
+{
   switch (voice->interp_method)
   {
     case FLUID_INTERP_NONE:
-      count = fluid_dsp_float_interpolate_none (voice);
-      break;
+      return fluid_dsp_float_interpolate_none (voice, dsp_left_buf, dsp_right_buf,
+					       dsp_reverb_buf, dsp_chorus_buf);
     case FLUID_INTERP_LINEAR:
-      count = fluid_dsp_float_interpolate_linear (voice);
-      break;
+      return fluid_dsp_float_interpolate_linear (voice, dsp_left_buf, dsp_right_buf,
+						 dsp_reverb_buf, dsp_chorus_buf);
     case FLUID_INTERP_4THORDER:
     default:
-      count = fluid_dsp_float_interpolate_4th_order (voice);
-      break;
+      return fluid_dsp_float_interpolate_4th_order (voice, dsp_left_buf, dsp_right_buf,
+						    dsp_reverb_buf, dsp_chorus_buf);
     case FLUID_INTERP_7THORDER:
-      count = fluid_dsp_float_interpolate_7th_order (voice);
-      break;
-  }
-
-  if (count > 0)
-    fluid_voice_effects (voice, count, dsp_left_buf, dsp_right_buf,
-			 dsp_reverb_buf, dsp_chorus_buf);
-
-  /* turn off voice if short count (sample ended and not looping) */
-  if (count < FLUID_BUFSIZE)
-  {
-      fluid_voice_off(voice);
+      return fluid_dsp_float_interpolate_7th_order (voice, dsp_left_buf, dsp_right_buf,
+						    dsp_reverb_buf, dsp_chorus_buf);
   }
-
- post_process:
-  voice->ticks += FLUID_BUFSIZE;
-  return FLUID_OK;
 }
 
-
-/* Purpose:
- *
- * - filters (applies a lowpass filter with variable cutoff frequency and quality factor)
- * - mixes the processed sample to left and right output using the pan setting
- * - sends the processed sample to chorus and reverb
- *
- * Variable description:
- * - dsp_data: Pointer to the original waveform data
- * - dsp_left_buf: The generated signal goes here, left channel
- * - dsp_right_buf: right channel
- * - dsp_reverb_buf: Send to reverb unit
- * - dsp_chorus_buf: Send to chorus unit
- * - dsp_a1: Coefficient for the filter
- * - dsp_a2: same
- * - dsp_b0: same
- * - dsp_b1: same
- * - dsp_b2: same
- * - voice holds the voice structure
- *
- * A couple of variables are used internally, their results are discarded:
- * - dsp_i: Index through the output buffer
- * - dsp_phase_fractional: The fractional part of dsp_phase
- * - dsp_coeff: A table of four coefficients, depending on the fractional phase.
- *              Used to interpolate between samples.
- * - dsp_process_buffer: Holds the processed signal between stages
- * - dsp_centernode: delay line for the IIR filter
- * - dsp_hist1: same
- * - dsp_hist2: same
+/*
+ * fluid_voice_write
  *
+ * This is where it all happens. This function is called by the
+ * synthesizer to generate the sound samples, once the control data of
+ * the block are set up. The synthesizer passes four audio buffers:
+ * left, right, reverb out, and chorus out.
  */
-static __inline void
-fluid_voice_effects (fluid_voice_t *voice, int count,
-		     fluid_real_t* dsp_left_buf, fluid_real_t* dsp_right_buf,
-		     fluid_real_t* dsp_reverb_buf, fluid_real_t* dsp_chorus_buf)
+int
+fluid_voice_write(fluid_voice_t* voice,
+		 fluid_real_t* dsp_left_buf, fluid_real_t* dsp_right_buf,
+		 fluid_real_t* dsp_reverb_buf, fluid_real_t* dsp_chorus_buf)
 {
-  /* IIR filter sample history */
-  fluid_real_t dsp_hist1 = voice->hist1;
-  fluid_real_t dsp_hist2 = voice->hist2;
-
-  /* IIR filter coefficients */
-  fluid_real_t dsp_a1 = voice->a1;
-  fluid_real_t dsp_a2 = voice->a2;
-  fluid_real_t dsp_b02 = voice->b02;
-  fluid_real_t dsp_b1 = voice->b1;
-  fluid_real_t dsp_a1_incr = voice->a1_incr;
-  fluid_real_t dsp_a2_incr = voice->a2_incr;
-  fluid_real_t dsp_b02_incr = voice->b02_incr;
-  fluid_real_t dsp_b1_incr = voice->b1_incr;
-  int dsp_filter_coeff_incr_count = voice->filter_coeff_incr_count;
-
-  fluid_real_t *dsp_buf = voice->dsp_buf;
-
-  fluid_real_t dsp_centernode;
-  int dsp_i;
-  float v;
-
-  /* filter (implement the voice filter according to SoundFont standard) */
-
-  /* Check for denormal number (too close to zero). */
-  if (fabs (dsp_hist1) < 1e-20) dsp_hist1 = 0.0f;  /* FIXME JMG - Is this even needed? */
-
-  /* Two versions of the filter loop. One, while the filter is
-  * changing towards its new setting. The other, if the filter
-  * doesn't change.
-  */
+  int count;
 
-  if (dsp_filter_coeff_incr_count > 0)
-  {
-    /* Increment is added to each filter coefficient filter_coeff_incr_count times. */
-    for (dsp_i = 0; dsp_i < count; dsp_i++)
-    {
-      /* The filter is implemented in Direct-II form. */
-      dsp_centernode = dsp_buf[dsp_i] - dsp_a1 * dsp_hist1 - dsp_a2 * dsp_hist2;
-      dsp_buf[dsp_i] = dsp_b02 * (dsp_centernode + dsp_hist2) + dsp_b1 * dsp_hist1;
-      dsp_hist2 = dsp_hist1;
-      dsp_hist1 = dsp_centernode;
-
-      if (dsp_filter_coeff_incr_count-- > 0)
-      {
-	dsp_a1 += dsp_a1_incr;
-	dsp_a2 += dsp_a2_incr;
-	dsp_b02 += dsp_b02_incr;
-	dsp_b1 += dsp_b1_incr;
-      }
-    } /* for dsp_i */
-  }
-  else /* The filter parameters are constant.  This is duplicated to save time. */
-  {
-    for (dsp_i = 0; dsp_i < count; dsp_i++)
-    { /* The filter is implemented in Direct-II form. */
-      dsp_centernode = dsp_buf[dsp_i] - dsp_a1 * dsp_hist1 - dsp_a2 * dsp_hist2;
-      dsp_buf[dsp_i] = dsp_b02 * (dsp_centernode + dsp_hist2) + dsp_b1 * dsp_hist1;
-      dsp_hist2 = dsp_hist1;
-      dsp_hist1 = dsp_centernode;
-    }
-  }
+  if (!_PLAYING(voice) || !voice->dsp->render) return FLUID_OK;
 
-  /* pan (Copy the signal to the left and right output buffer) The voice
-  * panning generator has a range of -500 .. 500.  If it is centered,
-  * it's close to 0.  voice->amp_left and voice->amp_right are then the
-  * same, and we can save one multiplication per voice and sample.
-  */
-  if ((-0.5 < voice->pan) && (voice->pan < 0.5))
-  {
-    /* The voice is centered. Use voice->amp_left twice. */
-    for (dsp_i = 0; dsp_i < count; dsp_i++)
-    {
-      v = voice->amp_left * dsp_buf[dsp_i];
-      dsp_left_buf[dsp_i] += v;
-      dsp_right_buf[dsp_i] += v;
-    }
-  }
-  else	/* The voice is not centered. Stereo samples have one side zero. */
+  /*********************** run the dsp chain ************************
+   * The sample is mixed with the output buffer.
+   * The buffer has to be filled from buf_start to buf_end-1, which is
+   * 0 to FLUID_BUFSIZE-1 except in the first and last block of a voice
+   * started or stopped inside a block.
+   * Depending on the position in the loop and the loop size, this
+   * may require several runs.
+   * A voice released inside the block keeps its amplitude up to the
+   * release, and only ramps from there. */
+
+  if (voice->dsp->ramp_start > voice->dsp->buf_start)
   {
-    if (voice->amp_left != 0.0)
-    {
-      for (dsp_i = 0; dsp_i < count; dsp_i++)
-	dsp_left_buf[dsp_i] += voice->amp_left * dsp_buf[dsp_i];
-    }
+    int buf_end = voice->dsp->buf_end;
+    fluid_real_t amp_incr = voice->dsp->amp_incr;
+
+    voice->dsp->buf_end = voice->dsp->ramp_start;
+    voice->dsp->amp_incr = 0.0f;
+    count = fluid_voice_interpolate (voice, dsp_left_buf, dsp_right_buf,
+				     dsp_reverb_buf, dsp_chorus_buf);
+    voice->dsp->buf_end = buf_end;
+    voice->dsp->amp_incr = amp_incr;
 
-    if (voice->amp_right != 0.0)
+    if (count < voice->dsp->ramp_start)
     {
-      for (dsp_i = 0; dsp_i < count; dsp_i++)
-	dsp_right_buf[dsp_i] += voice->amp_right * dsp_buf[dsp_i];
+      fluid_voice_off(voice);
+      return FLUID_OK;
     }
+    voice->dsp->buf_start = voice->dsp->ramp_start;
   }
 
-  /* reverb send. Buffer may be NULL. */
-  if ((dsp_reverb_buf != NULL) && (voice->amp_reverb != 0.0))
-  {
-    for (dsp_i = 0; dsp_i < count; dsp_i++)
-      dsp_reverb_buf[dsp_i] += voice->amp_reverb * dsp_buf[dsp_i];
-  }
+  count = fluid_voice_interpolate (voice, dsp_left_buf, dsp_right_buf,
+				   dsp_reverb_buf, dsp_chorus_buf);
 
-  /* chorus send. Buffer may be NULL. */
-  if ((dsp_chorus_buf != NULL) && (voice->amp_chorus != 0))
+  /* turn off voice if short count (sample ended and not looping, or
+   * the voice stops inside the block) */
+  if (count < FLUID_BUFSIZE)
   {
-    for (dsp_i = 0; dsp_i < count; dsp_i++)
-      dsp_chorus_buf[dsp_i] += voice->amp_chorus * dsp_buf[dsp_i];
+      fluid_voice_off(voice);
   }
 
-  voice->hist1 = dsp_hist1;
-  voice->hist2 = dsp_hist2;
-  voice->a1 = dsp_a1;
-  voice->a2 = dsp_a2;
-  voice->b02 = dsp_b02;
-  voice->b1 = dsp_b1;
-  voice->filter_coeff_incr_count = dsp_filter_coeff_incr_count;
+  return FLUID_OK;
 }
 
 /*
@@ -785,6 +821,40 @@ void fluid_voice_start(fluid_voice_t* voice)
   voice->status = FLUID_VOICE_ON;
 }
 
+/* Whether cc/ctrl is the source of any of the voice's modulators. It
+ * can say yes for a controller that isn't. */
+#define fluid_voice_has_mod_source(voice, cc, ctrl) \
+  ((voice)->mod_sources[(cc) != 0][((ctrl) >> 5) & 3] & (1u << ((ctrl) & 31)))
+
+/*
+ * fluid_voice_link_mods
+ *
+ * Sets up what fluid_voice_modulate() needs to only redo the
+ * modulators a controller change affects: the modulators with the
+ * same destination are chained in order, and the controllers used as
+ * a source are marked. It's done once per note, after all the
+ * modulators are added.
+ */
+static void
+fluid_voice_link_mods(fluid_voice_t* voice)
+{
+  fluid_mod_t* mod;
+  int i;
+
+  FLUID_MEMSET(voice->gen_mod_first, -1, sizeof(voice->gen_mod_first));
+  FLUID_MEMSET(voice->mod_sources, 0, sizeof(voice->mod_sources));
+
+  for (i = voice->mod_count - 1; i >= 0; i--) {
+    mod = &voice->mod[i];
+
+    voice->mod_dest_next[i] = voice->gen_mod_first[mod->dest];
+    voice->gen_mod_first[mod->dest] = (signed char) i;
+
+    voice->mod_sources[(mod->flags1 & FLUID_MOD_CC) != 0][(mod->src1 >> 5) & 3] |= 1u << (mod->src1 & 31);
+    voice->mod_sources[(mod->flags2 & FLUID_MOD_CC) != 0][(mod->src2 >> 5) & 3] |= 1u << (mod->src2 & 31);
+  }
+}
+
 /*
  * fluid_voice_calculate_runtime_synthesis_parameters
  *
@@ -872,12 +942,15 @@ fluid_voice_calculate_runtime_synthesis_parameters(fluid_voice_t* voice)
    * fluid_gen_set_default_values.
    */
 
+  fluid_voice_link_mods(voice);
+
   for (i = 0; i < voice->mod_count; i++) {
     fluid_mod_t* mod = &voice->mod[i];
     fluid_real_t modval = fluid_mod_get_value(mod, voice->channel, voice);
     int dest_gen_index = mod->dest;
     fluid_gen_t* dest_gen = &voice->gen[dest_gen_index];
     dest_gen->mod += modval;
+    voice->mod_value[i] = modval;
     /*      fluid_dump_modulator(mod); */
   }
 
@@ -1019,8 +1092,9 @@ fluid_voice_update_param(fluid_voice_t* voice, int gen)
   case GEN_PAN:
     /* range checking is done in the fluid_pan function */
     voice->pan = _GEN(voice, GEN_PAN);
-    voice->amp_left = fluid_pan(voice->pan, 1) * voice->synth_gain / 32768.0f;
-    voice->amp_right = fluid_pan(voice->pan, 0) * voice->synth_gain / 32768.0f;
+    voice->dsp->amp_left = fluid_pan(voice->pan, 1) * voice->synth_gain / 32768.0f;
+    voice->dsp->amp_right = fluid_pan(voice->pan, 0) * voice->synth_gain / 32768.0f;
+    fluid_voice_update_link_pan(voice);
     break;
 
   case GEN_ATTENUATION:
@@ -1049,14 +1123,14 @@ fluid_voice_update_param(fluid_voice_t* voice, int gen)
     /* The generator unit is 'tenths of a percent'. */
     voice->reverb_send = _GEN(voice, GEN_REVERBSEND) / 1000.0f;
     fluid_clip(voice->reverb_send, 0.0, 1.0);
-    voice->amp_reverb = voice->reverb_send * voice->synth_gain / 32768.0f;
+    voice->dsp->amp_reverb = voice->reverb_send * voice->synth_gain / 32768.0f;
     break;
 
   case GEN_CHORUSSEND:
     /* The generator unit is 'tenths of a percent'. */
     voice->chorus_send = _GEN(voice, GEN_CHORUSSEND) / 1000.0f;
     fluid_clip(voice->chorus_send, 0.0, 1.0);
-    voice->amp_chorus = voice->chorus_send * voice->synth_gain / 32768.0f;
+    voice->dsp->amp_chorus = voice->chorus_send * voice->synth_gain / 32768.0f;
     break;
 
   case GEN_OVERRIDEROOTKEY:
@@ -1155,7 +1229,7 @@ fluid_voice_update_param(fluid_voice_t* voice, int gen)
   case GEN_MODLFODELAY:
     x = _GEN(voice, GEN_MODLFODELAY);
     fluid_clip(x, -12000.0f, 5000.0f);
-    voice->modlfo_delay = (unsigned int) (voice->output_rate * fluid_tc2sec_delay(x));
+    voice->dsp->modlfo_delay = (unsigned int) (voice->output_rate * fluid_tc2sec_delay(x));
     break;
 
   case GEN_MODLFOFREQ:
@@ -1164,7 +1238,7 @@ fluid_voice_update_param(fluid_voice_t* voice, int gen)
      */
     x = _GEN(voice, GEN_MODLFOFREQ);
     fluid_clip(x, -16000.0f, 4500.0f);
-    voice->modlfo_incr = (4.0f * FLUID_BUFSIZE * fluid_act2hz(x) / voice->output_rate);
+    voice->dsp->modlfo_incr = (4.0f * FLUID_BUFSIZE * fluid_act2hz(x) / voice->output_rate);
     break;
 
   case GEN_VIBLFOFREQ:
@@ -1175,13 +1249,13 @@ fluid_voice_update_param(fluid_voice_t* voice, int gen)
      */
     x = _GEN(voice, GEN_VIBLFOFREQ);
     fluid_clip(x, -16000.0f, 4500.0f);
-    voice->viblfo_incr = (4.0f * FLUID_BUFSIZE * fluid_act2hz(x) / voice->output_rate);
+    voice->dsp->viblfo_incr = (4.0f * FLUID_BUFSIZE * fluid_act2hz(x) / voice->output_rate);
     break;
 
   case GEN_VIBLFODELAY:
     x = _GEN(voice,GEN_VIBLFODELAY);
     fluid_clip(x, -12000.0f, 5000.0f);
-    voice->viblfo_delay = (unsigned int) (voice->output_rate * fluid_tc2sec_delay(x));
+    voice->dsp->viblfo_delay = (unsigned int) (voice->output_rate * fluid_tc2sec_delay(x));
     break;
 
   case GEN_VIBLFOTOPITCH:
@@ -1438,39 +1512,59 @@ fluid_voice_update_param(fluid_voice_t* voice, int gen)
  * */
 int fluid_voice_modulate(fluid_voice_t* voice, int cc, int ctrl)
 {
-  int i, k;
+  int i, k, n;
   fluid_mod_t* mod;
   int gen;
   fluid_real_t modval;
+  unsigned char dirty[GEN_LAST];
+  unsigned char dirty_gen[GEN_LAST];
 
 /*    printf("Chan=%d, CC=%d, Src=%d, Val=%d\n", voice->channel->channum, cc, ctrl, val); */
 
+  /* most controllers aren't the source of any of the voice's modulators */
+  if (!fluid_voice_has_mod_source(voice, cc, ctrl)) {
+    return FLUID_OK;
+  }
+
+  FLUID_MEMSET(dirty, 0, sizeof(dirty));
+  n = 0;
+
   for (i = 0; i < voice->mod_count; i++) {
 
     mod = &voice->mod[i];
 
     /* step 1: find all the modulators that have the changed controller
-     * as input source. */
+     * as input source, and recalculate their output. */
     if (fluid_mod_has_source(mod, cc, ctrl)) {
 
-      gen = fluid_mod_get_dest(mod);
-      modval = 0.0;
+      voice->mod_value[i] = fluid_mod_get_value(mod, voice->channel, voice);
 
-      /* step 2: for every changed modulator, calculate the modulation
-       * value of its associated generator */
-      for (k = 0; k < voice->mod_count; k++) {
-	if (fluid_mod_has_dest(&voice->mod[k], gen)) {
-	  modval += fluid_mod_get_value(&voice->mod[k], voice->channel, voice);
-	}
+      gen = fluid_mod_get_dest(mod);
+      if (!dirty[gen]) {
+	dirty[gen] = 1;
+	dirty_gen[n++] = (unsigned char) gen;
       }
+    }
+  }
+
+  for (i = 0; i < n; i++) {
 
-      fluid_gen_set_mod(&voice->gen[gen], modval);
+    gen = dirty_gen[i];
+    modval = 0.0;
 
-      /* step 3: now that we have the new value of the generator,
-       * recalculate the parameter values that are derived from the
-       * generator */
-      fluid_voice_update_param(voice, gen);
+    /* step 2: for every changed generator, add up the outputs of the
+     * modulators that have it as destination. The others didn't
+     * change, so their last output is still right. */
+    for (k = voice->gen_mod_first[gen]; k >= 0; k = voice->mod_dest_next[k]) {
+      modval += voice->mod_value[k];
     }
+
+    fluid_gen_set_mod(&voice->gen[gen], modval);
+
+    /* step 3: now that we have the new value of the generator,
+     * recalculate the parameter values that are derived from the
+     * generator */
+    fluid_voice_update_param(voice, gen);
   }
   return FLUID_OK;
 }
@@ -1484,31 +1578,28 @@ int fluid_voice_modulate(fluid_voice_t* voice, int cc, int ctrl)
  */
 int fluid_voice_modulate_all(fluid_voice_t* voice)
 {
-  fluid_mod_t* mod;
   int i, k, gen;
   fluid_real_t modval;
 
-  /* Loop through all the modulators.
+  for (i = 0; i < voice->mod_count; i++) {
+    voice->mod_value[i] = fluid_mod_get_value(&voice->mod[i], voice->channel, voice);
+  }
 
-     FIXME: we should loop through the set of generators instead of
-     the set of modulators. We risk to call 'fluid_voice_update_param'
-     several times for the same generator if several modulators have
-     that generator as destination. It's not an error, just a wast of
-     energy (think polution, global warming, unhappy musicians,
-     ...) */
+  /* Loop through the generators that are the destination of some
+   * modulator, in the order of their first modulator. */
 
   for (i = 0; i < voice->mod_count; i++) {
 
-    mod = &voice->mod[i];
-    gen = fluid_mod_get_dest(mod);
+    gen = fluid_mod_get_dest(&voice->mod[i]);
+    if (voice->gen_mod_first[gen] != i) {
+      continue;
+    }
     modval = 0.0;
 
     /* Accumulate the modulation values of all the modulators with
      * destination generator 'gen' */
-    for (k = 0; k < voice->mod_count; k++) {
-      if (fluid_mod_has_dest(&voice->mod[k], gen)) {
-	modval += fluid_mod_get_value(&voice->mod[k], voice->channel, voice);
-      }
+    for (k = i; k >= 0; k = voice->mod_dest_next[k]) {
+      modval += voice->mod_value[k];
     }
 
     fluid_gen_set_mod(&voice->gen[gen], modval);
@@ -1540,25 +1631,25 @@ fluid_voice_noteoff(fluid_voice_t* voice)
   if (voice->channel && fluid_channel_sustained(voice->channel)) {
     voice->status = FLUID_VOICE_SUSTAINED;
   } else {
-    if (voice->volenv_section == FLUID_VOICE_ENVATTACK) {
+    if (voice->dsp->volenv_section == FLUID_VOICE_ENVATTACK) {
       /* A voice is turned off during the attack section of the volume
        * envelope.  The attack section ramps up linearly with
        * amplitude. The other sections use logarithmic scaling. Calculate new
        * volenv_val to achieve equievalent amplitude during the release phase
        * for seamless volume transition.
        */
-      if (voice->volenv_val > 0){
-	fluid_real_t lfo = voice->modlfo_val * -voice->modlfo_to_vol;
-        fluid_real_t amp = voice->volenv_val * pow (10.0, lfo / -200);
+      if (voice->dsp->volenv_val > 0){
+	fluid_real_t lfo = voice->dsp->modlfo_val * -voice->modlfo_to_vol;
+        fluid_real_t amp = voice->dsp->volenv_val * pow (10.0, lfo / -200);
         fluid_real_t env_value = - ((-200 * log (amp) / log (10.0) - lfo) / 960.0 - 1);
 	fluid_clip (env_value, 0.0, 1.0);
-        voice->volenv_val = env_value;
+        voice->dsp->volenv_val = env_value;
       }
     }
-    voice->volenv_section = FLUID_VOICE_ENVRELEASE;
-    voice->volenv_count = 0;
-    voice->modenv_section = FLUID_VOICE_ENVRELEASE;
-    voice->modenv_count = 0;
+    voice->dsp->volenv_section = FLUID_VOICE_ENVRELEASE;
+    voice->dsp->volenv_count = 0;
+    voice->dsp->modenv_section = FLUID_VOICE_ENVRELEASE;
+    voice->dsp->modenv_count = 0;
   }
 
   return FLUID_OK;
@@ -1588,11 +1679,11 @@ fluid_voice_kill_excl(fluid_voice_t* voice){
   fluid_voice_gen_set(voice, GEN_EXCLUSIVECLASS, 0);
 
   /* If the voice is not yet in release state, put it into release state */
-  if (voice->volenv_section != FLUID_VOICE_ENVRELEASE){
-    voice->volenv_section = FLUID_VOICE_ENVRELEASE;
-    voice->volenv_count = 0;
-    voice->modenv_section = FLUID_VOICE_ENVRELEASE;
-    voice->modenv_count = 0;
+  if (voice->dsp->volenv_section != FLUID_VOICE_ENVRELEASE){
+    voice->dsp->volenv_section = FLUID_VOICE_ENVRELEASE;
+    voice->dsp->volenv_count = 0;
+    voice->dsp->modenv_section = FLUID_VOICE_ENVRELEASE;
+    voice->dsp->modenv_count = 0;
   }
 
   /* Speed up the volume envelope */
@@ -1618,10 +1709,10 @@ int
 fluid_voice_off(fluid_voice_t* voice)
 {
   voice->chan = NO_CHANNEL;
-  voice->volenv_section = FLUID_VOICE_ENVFINISHED;
-  voice->volenv_count = 0;
-  voice->modenv_section = FLUID_VOICE_ENVFINISHED;
-  voice->modenv_count = 0;
+  voice->dsp->volenv_section = FLUID_VOICE_ENVFINISHED;
+  voice->dsp->volenv_count = 0;
+  voice->dsp->modenv_section = FLUID_VOICE_ENVFINISHED;
+  voice->dsp->modenv_count = 0;
   voice->status = FLUID_VOICE_OFF;
 
   /* Decrement the reference count of the sample. */
@@ -1629,6 +1720,74 @@ fluid_voice_off(fluid_voice_t* voice)
     fluid_sample_decr_ref(voice->sample);
     voice->sample = NULL;
   }
+  if (voice->link_sample) {
+    fluid_sample_decr_ref(voice->link_sample);
+    voice->link_sample = NULL;
+    voice->link_data = NULL;
+  }
+
+  /* ... and of the soundfont, which may now be deleted */
+  if (voice->sfont) {
+    fluid_sfont_decr_ref(voice->sfont);
+    voice->sfont = NULL;
+  }
+
+  return FLUID_OK;
+}
+
+/*
+ * fluid_voice_set_start_offset
+ *
+ * Has a voice that hasn't played yet start offset frames into the
+ * synth's next block instead of at its start. The offset may be more
+ * than a block; the voice waits out the whole blocks before it.
+ */
+void
+fluid_voice_set_start_offset(fluid_voice_t* voice, int offset)
+{
+  voice->dsp->start_offset = (offset > 0) ? offset : 0;
+}
+
+/*
+ * fluid_voice_noteoff_at
+ *
+ * A note-off offset frames into the synth's next block. The release
+ * begins on that frame: the envelopes enter it for the block, and the
+ * amplitude holds until the frame and ramps from there. A voice held
+ * by the sustain pedal is marked sustained at once, as by
+ * fluid_voice_noteoff(). An earlier release that is still pending
+ * stays.
+ */
+int
+fluid_voice_noteoff_at(fluid_voice_t* voice, int offset)
+{
+  if ((offset <= 0) || (voice->channel && fluid_channel_sustained(voice->channel))) {
+    return fluid_voice_noteoff(voice);
+  }
+
+  if ((voice->dsp->release_offset < 0) || (offset < voice->dsp->release_offset)) {
+    voice->dsp->release_offset = offset;
+  }
+  return FLUID_OK;
+}
+
+/*
+ * fluid_voice_stop_at
+ *
+ * Turns off a voice offset frames into the synth's next block, where
+ * fluid_voice_off() does so at once. The interpolation stops on that
+ * frame. An earlier stop that is still pending stays.
+ */
+int
+fluid_voice_stop_at(fluid_voice_t* voice, int offset)
+{
+  if (offset <= 0) {
+    return fluid_voice_off(voice);
+  }
+
+  if ((voice->dsp->stop_offset < 0) || (offset < voice->dsp->stop_offset)) {
+    voice->dsp->stop_offset = offset;
+  }
 
   return FLUID_OK;
 }
@@ -1856,8 +2015,16 @@ void fluid_voice_check_sample_sanity(fluid_voice_t* voice)
       if ((int)voice->loopstart >= (int)voice->sample->loopstart
 	  && (int)voice->loopend <= (int)voice->sample->loopend){
 	/* Is there a valid peak amplitude available for the loop? */
-	if (voice->sample->amplitude_that_reaches_noise_floor_is_valid){
-	  voice->amplitude_that_reaches_noise_floor_loop=voice->sample->amplitude_that_reaches_noise_floor / voice->synth_gain;
+	if (voice->sample->amplitude_that_reaches_noise_floor_is_valid
+	    && (voice->link_sample == NULL
+		|| voice->link_sample->amplitude_that_reaches_noise_floor_is_valid)){
+	  double amplitude = voice->sample->amplitude_that_reaches_noise_floor;
+	  /* the louder of the two channels decides for a stereo voice */
+	  if (voice->link_sample != NULL
+	      && voice->link_sample->amplitude_that_reaches_noise_floor < amplitude){
+	    amplitude = voice->link_sample->amplitude_that_reaches_noise_floor;
+	  }
+	  voice->amplitude_that_reaches_noise_floor_loop=amplitude / voice->synth_gain;
 	} else {
 	  /* Worst case */
 	  voice->amplitude_that_reaches_noise_floor_loop=voice->amplitude_that_reaches_noise_floor_nonloop;
@@ -1877,12 +2044,12 @@ void fluid_voice_check_sample_sanity(fluid_voice_t* voice)
 
       /* Set the initial phase of the voice (using the result from the
 	 start offset modulators). */
-      fluid_phase_set_int(voice->phase, voice->start);
+      fluid_phase_set_int(voice->dsp->phase, voice->start);
     } /* if startup */
 
     /* Is this voice run in loop mode, or does it run straight to the
        end of the waveform data? */
-    if (((_SAMPLEMODE(voice) == FLUID_LOOP_UNTIL_RELEASE) && (voice->volenv_section < FLUID_VOICE_ENVRELEASE))
+    if (((_SAMPLEMODE(voice) == FLUID_LOOP_UNTIL_RELEASE) && (voice->dsp->volenv_section < FLUID_VOICE_ENVRELEASE))
 	|| (_SAMPLEMODE(voice) == FLUID_LOOP_DURING_RELEASE)) {
       /* Yes, it will loop as soon as it reaches the loop point.  In
        * this case we must prevent, that the playback pointer (phase)
@@ -1895,10 +2062,10 @@ void fluid_voice_check_sample_sanity(fluid_voice_t* voice)
        * the sample, enter the loop and proceed as expected => no
        * actions required.
        */
-      int index_in_sample = fluid_phase_index(voice->phase);
+      int index_in_sample = fluid_phase_index(voice->dsp->phase);
       if (index_in_sample >= voice->loopend){
 	/* FLUID_LOG(FLUID_DBG, "Loop / sample sanity check: Phase after 2nd loop point!"); */
-	fluid_phase_set_int(voice->phase, voice->loopstart);
+	fluid_phase_set_int(voice->dsp->phase, voice->loopstart);
       }
     }
 /*    FLUID_LOG(FLUID_DBG, "Loop / sample sanity check: Sample from %i to %i, loop from %i to %i", voice->start, voice->end, voice->loopstart, voice->loopend); */
@@ -1928,10 +2095,11 @@ int fluid_voice_set_gain(fluid_voice_t* voice, fluid_real_t gain)
   }
 
   voice->synth_gain = gain;
-  voice->amp_left = fluid_pan(voice->pan, 1) * gain / 32768.0f;
-  voice->amp_right = fluid_pan(voice->pan, 0) * gain / 32768.0f;
-  voice->amp_reverb = voice->reverb_send * gain / 32768.0f;
-  voice->amp_chorus = voice->chorus_send * gain / 32768.0f;
+  voice->dsp->amp_left = fluid_pan(voice->pan, 1) * gain / 32768.0f;
+  voice->dsp->amp_right = fluid_pan(voice->pan, 0) * gain / 32768.0f;
+  fluid_voice_update_link_pan(voice);
+  voice->dsp->amp_reverb = voice->reverb_send * gain / 32768.0f;
+  voice->dsp->amp_chorus = voice->chorus_send * gain / 32768.0f;
 
   return FLUID_OK;
 }
@@ -60,6 +60,78 @@ enum fluid_voice_envelope_index_t{
 	FLUID_VOICE_ENVLAST
 };
 
+/*
+ * fluid_voice_dsp_t
+ *
+ * The part of a voice that fluid_voice_write() reads and updates every
+ * block. The synth keeps these for all its voices in one array, so
+ * going through the playing voices touches a few lines per voice
+ * rather than all of the generator and modulator tables.
+ */
+typedef struct _fluid_voice_dsp_t fluid_voice_dsp_t;
+
+struct _fluid_voice_dsp_t
+{
+	fluid_phase_t phase;             /* the phase of the sample wave */
+	fluid_real_t phase_incr;         /* the phase increment for the next 64 samples */
+	fluid_real_t amp;                /* current linear amplitude */
+	fluid_real_t amp_incr;           /* amplitude increment value */
+	int render;                      /* set by fluid_voice_update_control() if the block makes sound */
+
+	/* sub-block timing, see fluid_voice_set_start_offset(), fluid_voice_noteoff_at()
+	 * and fluid_voice_stop_at() */
+	int start_offset;                /* frames into the next block the voice starts at */
+	int stop_offset;                 /* frames into the next block it stops at, -1 for none */
+	int release_offset;              /* frames into the next block it is released at, -1 for none */
+	int buf_start;                   /* the frames of this block the voice plays */
+	int buf_end;
+	int ramp_start;                  /* the frame the amplitude ramp starts at, see fluid_voice_write() */
+
+	/* vol env */
+	unsigned int volenv_count;
+	int volenv_section;
+	fluid_real_t volenv_val;
+
+	/* mod env */
+	unsigned int modenv_count;
+	int modenv_section;
+	fluid_real_t modenv_val;         /* the value of the modulation envelope */
+
+	/* mod lfo */
+	fluid_real_t modlfo_val;         /* the value of the modulation LFO */
+	unsigned int modlfo_delay;       /* the delay of the lfo in samples */
+	fluid_real_t modlfo_incr;        /* the lfo frequency is converted to a per-buffer increment */
+
+	/* vib lfo */
+	fluid_real_t viblfo_val;         /* the value of the vibrato LFO */
+	unsigned int viblfo_delay;       /* the delay of the lfo in samples */
+	fluid_real_t viblfo_incr;        /* the lfo frequency is converted to a per-buffer increment */
+
+	/* filter coefficients */
+	/* The coefficients are normalized to a0. */
+	/* b0 and b2 are identical => b02 */
+	fluid_real_t b02;                /* b0 / a0 */
+	fluid_real_t b1;                 /* b1 / a0 */
+	fluid_real_t a1;                 /* a0 / a0 */
+	fluid_real_t a2;                 /* a1 / a0 */
+
+	fluid_real_t b02_incr;
+	fluid_real_t b1_incr;
+	fluid_real_t a1_incr;
+	fluid_real_t a2_incr;
+	int filter_coeff_incr_count;
+	fluid_real_t hist1, hist2;       /* Sample history for the IIR filter */
+	fluid_real_t link_hist1, link_hist2; /* the same for the second channel */
+
+	/* pan and effects sends */
+	fluid_real_t amp_left;
+	fluid_real_t amp_right;
+	fluid_real_t link_amp_left;      /* the pan of the second channel */
+	fluid_real_t link_amp_right;
+	fluid_real_t amp_reverb;
+	fluid_real_t amp_chorus;
+};
+
 /*
  * fluid_voice_t
  */
@@ -72,11 +144,27 @@ struct _fluid_voice_t
 	unsigned char key;              /* the key, quick acces for noteoff */
 	unsigned char vel;              /* the velocity */
 	fluid_channel_t* channel;
+	fluid_voice_t* key_next;        /* the next voice in the synth's list for this channel and key */
+	fluid_voice_t** key_prevp;      /* what points to this voice in that list, NULL if not in one */
+	fluid_real_t steal_prio;        /* how much the voice matters, as of the synth's last look */
+	int steal_index;                /* the position in the synth's steal heap, -1 if not in it */
+	fluid_sfont_t* sfont;           /* the soundfont the voice was started from, or NULL */
 	fluid_gen_t gen[GEN_LAST];
 	fluid_mod_t mod[FLUID_NUM_MOD];
 	int mod_count;
+	/* The modulators as set up at the start of the note, see fluid_voice_link_mods() */
+	fluid_real_t mod_value[FLUID_NUM_MOD];   /* the last output of each modulator */
+	signed char mod_dest_next[FLUID_NUM_MOD]; /* the next modulator with the same destination, -1 at the end */
+	signed char gen_mod_first[GEN_LAST];     /* the first modulator with each generator as destination, -1 if none */
+	unsigned int mod_sources[2][4];          /* a bit for each controller number (cc: [1]) that is some modulator's source */
 	int has_looped;                 /* Flag that is set as soon as the first loop is completed. */
 	fluid_sample_t* sample;
+	/* The other half of a stereo sample pair, played by the same voice
+	 * (see fluid_voice_set_link()), or NULL */
+	fluid_sample_t* link_sample;
+	short int* link_data;           /* link_sample's data, lined up so that the indices into
+					   sample's data work for it too */
+	fluid_real_t link_pan;          /* the pan of link_sample's zone, the value of GEN_PAN for it */
 	int check_sample_sanity_flag;   /* Flag that initiates, that sample-related parameters
 					   have to be checked. */
 #if 0
@@ -109,16 +197,8 @@ struct _fluid_voice_t
 	unsigned int ticks;
     unsigned int noteoff_ticks;      /* Delay note-off until this tick */
 
-	fluid_real_t amp;                /* current linear amplitude */
-	fluid_phase_t phase;             /* the phase of the sample wave */
-
-	/* Temporary variables used in fluid_voice_write() */
-
-	fluid_real_t phase_incr;	/* the phase increment for the next 64 samples */
-	fluid_real_t amp_incr;		/* amplitude increment value */
-	fluid_real_t *dsp_buf;		/* buffer to store interpolated sample data to */
-
-	/* End temporary variables */
+	fluid_voice_dsp_t* dsp;          /* the state fluid_voice_write() works on, kept
+					    by the synth with that of the other voices */
 
 	/* basic parameters */
 	fluid_real_t pitch;              /* the pitch in midicents */
@@ -138,71 +218,41 @@ struct _fluid_voice_t
 
 	/* vol env */
 	fluid_env_data_t volenv_data[FLUID_VOICE_ENVLAST];
-	unsigned int volenv_count;
-	int volenv_section;
-	fluid_real_t volenv_val;
 	fluid_real_t amplitude_that_reaches_noise_floor_nonloop;
 	fluid_real_t amplitude_that_reaches_noise_floor_loop;
 
 	/* mod env */
 	fluid_env_data_t modenv_data[FLUID_VOICE_ENVLAST];
-	unsigned int modenv_count;
-	int modenv_section;
-	fluid_real_t modenv_val;         /* the value of the modulation envelope */
 	fluid_real_t modenv_to_fc;
 	fluid_real_t modenv_to_pitch;
 
 	/* mod lfo */
-	fluid_real_t modlfo_val;          /* the value of the modulation LFO */
-	unsigned int modlfo_delay;       /* the delay of the lfo in samples */
-	fluid_real_t modlfo_incr;         /* the lfo frequency is converted to a per-buffer increment */
 	fluid_real_t modlfo_to_fc;
 	fluid_real_t modlfo_to_pitch;
 	fluid_real_t modlfo_to_vol;
 
 	/* vib lfo */
-	fluid_real_t viblfo_val;        /* the value of the vibrato LFO */
-	unsigned int viblfo_delay;      /* the delay of the lfo in samples */
-	fluid_real_t viblfo_incr;       /* the lfo frequency is converted to a per-buffer increment */
 	fluid_real_t viblfo_to_pitch;
 
 	/* resonant filter */
 	fluid_real_t fres;              /* the resonance frequency, in cents (not absolute cents) */
 	fluid_real_t last_fres;         /* Current resonance frequency of the IIR filter */
+	fluid_real_t next_fres;         /* the frequency the filter is being set to this block */
 	/* Serves as a flag: A deviation between fres and last_fres */
 	/* indicates, that the filter has to be recalculated. */
 	fluid_real_t q_lin;             /* the q-factor on a linear scale */
 	fluid_real_t filter_gain;       /* Gain correction factor, depends on q */
-	fluid_real_t hist1, hist2;      /* Sample history for the IIR filter */
 	int filter_startup;             /* Flag: If set, the filter will be set directly.
 					   Else it changes smoothly. */
 
-	/* filter coefficients */
-	/* The coefficients are normalized to a0. */
-	/* b0 and b2 are identical => b02 */
-	fluid_real_t b02;              /* b0 / a0 */
-	fluid_real_t b1;              /* b1 / a0 */
-	fluid_real_t a1;              /* a0 / a0 */
-	fluid_real_t a2;              /* a1 / a0 */
-
-	fluid_real_t b02_incr;
-	fluid_real_t b1_incr;
-	fluid_real_t a1_incr;
-	fluid_real_t a2_incr;
-	int filter_coeff_incr_count;
-
 	/* pan */
 	fluid_real_t pan;
-	fluid_real_t amp_left;
-	fluid_real_t amp_right;
 
 	/* reverb */
 	fluid_real_t reverb_send;
-	fluid_real_t amp_reverb;
 
 	/* chorus */
 	fluid_real_t chorus_send;
-	fluid_real_t amp_chorus;
 
     /* interpolation method, as in fluid_interp in fluidlite.h */
 	int interp_method;
@@ -212,11 +262,14 @@ struct _fluid_voice_t
 };
 
 
-fluid_voice_t* new_fluid_voice(fluid_real_t output_rate);
+fluid_voice_t* new_fluid_voice(fluid_real_t output_rate, fluid_voice_dsp_t* dsp);
 int delete_fluid_voice(fluid_voice_t* voice);
 
 void fluid_voice_start(fluid_voice_t* voice);
 
+int fluid_voice_update_control(fluid_voice_t* voice, fluid_real_t* omega);
+void fluid_voice_update_filter(fluid_voice_t* voice, fluid_real_t sin_coeff, fluid_real_t cos_coeff);
+
 int fluid_voice_write(fluid_voice_t* voice,
 		      fluid_real_t* left, fluid_real_t* right,
 		      fluid_real_t* reverb_buf, fluid_real_t* chorus_buf);
@@ -224,6 +277,7 @@ int fluid_voice_write(fluid_voice_t* voice,
 int fluid_voice_init(fluid_voice_t* voice, fluid_sample_t* sample,
 		     fluid_channel_t* channel, int key, int vel,
 		     unsigned int id, unsigned int time, fluid_real_t gain);
+int fluid_voice_set_link(fluid_voice_t* voice, fluid_sample_t* sample, fluid_real_t pan);
 
 int fluid_voice_modulate(fluid_voice_t* voice, int cc, int ctrl);
 int fluid_voice_modulate_all(fluid_voice_t* voice);
@@ -244,6 +298,9 @@ void fluid_voice_update_param(fluid_voice_t* voice, int gen);
 
 int fluid_voice_noteoff(fluid_voice_t* voice);
 int fluid_voice_off(fluid_voice_t* voice);
+void fluid_voice_set_start_offset(fluid_voice_t* voice, int offset);
+int fluid_voice_noteoff_at(fluid_voice_t* voice, int offset);
+int fluid_voice_stop_at(fluid_voice_t* voice, int offset);
 int fluid_voice_calculate_runtime_synthesis_parameters(fluid_voice_t* voice);
 fluid_channel_t* fluid_voice_get_channel(fluid_voice_t* voice);
 int calculate_hold_decay_buffers(fluid_voice_t* voice, int gen_base,
@@ -262,7 +319,7 @@ void fluid_voice_check_sample_sanity(fluid_voice_t* voice);
 /* A voice is 'ON', if it has not yet received a noteoff
  * event. Sending a noteoff event will advance the envelopes to
  * section 5 (release). */
-#define _ON(voice)  ((voice)->status == FLUID_VOICE_ON && (voice)->volenv_section < FLUID_VOICE_ENVRELEASE)
+#define _ON(voice)  ((voice)->status == FLUID_VOICE_ON && (voice)->dsp->volenv_section < FLUID_VOICE_ENVRELEASE)
 #define _SUSTAINED(voice)  ((voice)->status == FLUID_VOICE_SUSTAINED)
 #define _AVAILABLE(voice)  (((voice)->status == FLUID_VOICE_CLEAN) || ((voice)->status == FLUID_VOICE_OFF))
 #define _RELEASED(voice)  ((voice)->chan == NO_CHANNEL)
@@ -282,10 +339,28 @@ fluid_real_t fluid_voice_gen_value(fluid_voice_t* voice, int num);
 
 /* defined in fluid_dsp_float.c */
 
+/* the interpolation kernels fluid_dsp_float_set_simd can choose */
+enum fluid_dsp_simd
+{
+	FLUID_DSP_SIMD_NONE,
+	FLUID_DSP_SIMD_SSE2,
+	FLUID_DSP_SIMD_AVX2,
+	FLUID_DSP_SIMD_NEON
+};
+
 void fluid_dsp_float_config (void);
-int fluid_dsp_float_interpolate_none (fluid_voice_t *voice);
-int fluid_dsp_float_interpolate_linear (fluid_voice_t *voice);
-int fluid_dsp_float_interpolate_4th_order (fluid_voice_t *voice);
-int fluid_dsp_float_interpolate_7th_order (fluid_voice_t *voice);
+int fluid_dsp_float_set_simd (int enable);
+int fluid_dsp_float_interpolate_none (fluid_voice_t *voice,
+				      fluid_real_t* left_buf, fluid_real_t* right_buf,
+				      fluid_real_t* reverb_buf, fluid_real_t* chorus_buf);
+int fluid_dsp_float_interpolate_linear (fluid_voice_t *voice,
+				      fluid_real_t* left_buf, fluid_real_t* right_buf,
+				      fluid_real_t* reverb_buf, fluid_real_t* chorus_buf);
+int fluid_dsp_float_interpolate_4th_order (fluid_voice_t *voice,
+				      fluid_real_t* left_buf, fluid_real_t* right_buf,
+				      fluid_real_t* reverb_buf, fluid_real_t* chorus_buf);
+int fluid_dsp_float_interpolate_7th_order (fluid_voice_t *voice,
+				      fluid_real_t* left_buf, fluid_real_t* right_buf,
+				      fluid_real_t* reverb_buf, fluid_real_t* chorus_buf);
 
 #endif /* _FLUID_VOICE_H */
@@ -192,6 +192,23 @@ typedef FILE*  fluid_file;
 #define fluid_clip(_val, _min, _max) \
 { (_val) = ((_val) < (_min))? (_min) : (((_val) > (_max))? (_max) : (_val)); }
 
+/* Atomic counters, for reference counts and work queues that are shared
+   between threads */
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define fluid_atomic_int_inc(_pi)           _InterlockedIncrement((long volatile*)(_pi))
+#define fluid_atomic_int_dec(_pi)           _InterlockedDecrement((long volatile*)(_pi))
+#define fluid_atomic_int_dec_and_test(_pi)  (_InterlockedDecrement((long volatile*)(_pi)) == 0)
+#define fluid_atomic_int_fetch_add(_pi, _v) _InterlockedExchangeAdd((long volatile*)(_pi), (_v))
+#define fluid_atomic_int_get(_pi)           _InterlockedExchangeAdd((long volatile*)(_pi), 0)
+#else
+#define fluid_atomic_int_inc(_pi)           __sync_add_and_fetch((_pi), 1)
+#define fluid_atomic_int_dec(_pi)           __sync_sub_and_fetch((_pi), 1)
+#define fluid_atomic_int_dec_and_test(_pi)  (__sync_sub_and_fetch((_pi), 1) == 0)
+#define fluid_atomic_int_fetch_add(_pi, _v) __sync_fetch_and_add((_pi), (_v))
+#define fluid_atomic_int_get(_pi)           __sync_fetch_and_add((_pi), 0)
+#endif
+
 #if WITH_FTS
 #define FLUID_PRINTF                 post
 #define FLUID_FLUSH()
@@ -11,6 +11,16 @@
 //==============================================================================
 MainComponent::MainComponent()
 {
+    // Soundfonts load in the background, so errors come back later
+    soundfontPlayer.onSoundfontLoaded = [] (const File& soundfontFile, bool loadedOk)
+    {
+        if (! loadedOk) {
+            AlertWindow::showMessageBoxAsync(AlertWindow::WarningIcon, "Invalid .sf2 File",
+                                             "Could not load your soundfont file: "
+                                             + soundfontFile.getFullPathName());
+        }
+    };
+    
     // Populate Soundfonts
     soundfontFiles = getSoundfontsDirectory().findChildFiles(File::findFiles, false, "*.sf2");
     for (auto f : soundfontFiles) {
@@ -9,27 +9,217 @@
 */
 
 #include "SoundfontAudioSource.h"
+#include <climits>
+#include <cstdlib>
 
 //==============================================================================
 //==============================================================================
-SoundfontAudioSource::SoundfontAudioSource(int numberOfVoices)
+SoundfontPool::SoundfontPool()
+{
+}
+
+SoundfontPool::~SoundfontPool()
+{
+    for (auto* entry : entries) {
+        jassert (entry->numHandles == 0);
+        entry->sfont->free(entry->sfont);
+    }
+}
+
+fluid_sfont_t* SoundfontPool::acquire (const File& file, fluid_synth_t* synth)
+{
+    const String path = getCanonicalPath(file);
+    const Time modificationTime = File(path).getLastModificationTime();
+    
+    {
+        const ScopedLock l (lock);
+        if (Entry* entry = findEntry(path, modificationTime)) {
+            return createHandle(*entry);
+        }
+    }
+    
+    // Load without holding the lock, so other files can be fetched meanwhile
+    fluid_sfont_t* sfont = fluid_synth_load_sfont(synth, path.toRawUTF8());
+    if (sfont == nullptr) {
+        return nullptr;
+    }
+    
+    const ScopedLock l (lock);
+    Entry* entry = findEntry(path, modificationTime);
+    
+    if (entry != nullptr) {
+        // Someone else loaded the same file while we were busy
+        sfont->free(sfont);
+    }
+    else {
+        entry = entries.add(new Entry { path, modificationTime, sfont, 0 });
+    }
+    return createHandle(*entry);
+}
+
+String SoundfontPool::getCanonicalPath (const File& file)
+{
+   #if JUCE_WINDOWS
+    wchar_t buffer[_MAX_PATH];
+    if (_wfullpath(buffer, file.getLinkedTarget().getFullPathName().toWideCharPointer(), _MAX_PATH) != nullptr) {
+        // Paths aren't case sensitive here
+        return String(buffer).toLowerCase();
+    }
+   #else
+    char buffer[PATH_MAX];
+    if (realpath(file.getFullPathName().toRawUTF8(), buffer) != nullptr) {
+        return String::fromUTF8(buffer);
+    }
+   #endif
+    
+    // Doesn't exist - loading it will fail anyway
+    return file.getFullPathName();
+}
+
+SoundfontPool::Entry* SoundfontPool::findEntry (const String& path, Time modificationTime)
+{
+    for (auto* entry : entries) {
+        if (entry->path == path && entry->modificationTime == modificationTime) {
+            return entry;
+        }
+    }
+    return nullptr;
+}
+
+fluid_sfont_t* SoundfontPool::createHandle (Entry& entry)
+{
+    fluid_sfont_t* handle = fluid_synth_share_sfont(entry.sfont);
+    if (handle != nullptr) {
+        handleEntries.set(handle, &entry);
+        ++entry.numHandles;
+    }
+    return handle;
+}
+
+fluid_sfont_t* SoundfontPool::share (fluid_sfont_t* handle)
+{
+    const ScopedLock l (lock);
+    Entry* entry = handleEntries[handle];
+    
+    // Not one of ours
+    jassert (entry != nullptr);
+    
+    return entry != nullptr ? createHandle(*entry) : nullptr;
+}
+
+void SoundfontPool::release (fluid_sfont_t* handle)
+{
+    fluid_sfont_t* unused = nullptr;
+    {
+        const ScopedLock l (lock);
+        Entry* entry = handleEntries[handle];
+        
+        // Not one of ours
+        jassert (entry != nullptr);
+        
+        if (entry != nullptr) {
+            handleEntries.remove(handle);
+            if (--entry->numHandles == 0) {
+                unused = entry->sfont;
+                entries.removeObject(entry);
+            }
+        }
+    }
+    
+    const int err = handle->free(handle);
+    jassert (err == 0);
+    ignoreUnused (err);
+    
+    if (unused != nullptr) {
+        unused->free(unused);
+    }
+}
+
+//==============================================================================
+//==============================================================================
+SoundfontAudioSource::SoundfontAudioSource(int numberOfVoices, int numberOfBuses,
+                                           int numberOfRenderThreads, RenderMode renderMode)
+    : Thread ("Soundfont Loader"),
+      numBuses (jlimit(1, (int) maxBuses, numberOfBuses))
 {
     settings = new_fluid_settings();
-    synth = new_fluid_synth(settings);
     
-    fluid_synth_set_polyphony(synth, numberOfVoices);
-    setGain(1.0f);
+    // One stereo buffer per bus; fluidsynth sends MIDI channel n to bus (n % numBuses)
+    fluid_settings_setint(settings, "synth.audio-channels", numBuses);
+    fluid_settings_setint(settings, "synth.audio-groups", numBuses);
+    
+    if (renderMode == splitChannels) {
+        numShards = jlimit(1, (int) maxShards, numberOfRenderThreads);
+    }
+    else {
+        fluid_settings_setint(settings, "synth.cpu-cores", jmax(1, numberOfRenderThreads));
+    }
+    
+    // The audio thread isn't running yet, so it's safe to talk to the synths directly
+    for (int i = 0; i < numShards; ++i) {
+        shards[i] = new_fluid_synth(settings);
+        fluid_synth_set_polyphony(shards[i], numberOfVoices);
+        fluid_synth_set_gain(shards[i], 1.0f);
+    }
+    synth = shards[0];
+    
+    changedChannels = ((uint32) 1 << numMidiChannels) - 1;
+    publishControllerValues();
+    
+    blockSize = fluid_synth_get_internal_bufsize(synth);
+    monoBlock.setSize(2, blockSize);
+    
+    if (numShards > 1) {
+        shardBlocks.setSize(numShards * (2 * numBuses + 2), blockSize);
+        mixedBlock.setSize(2 * numBuses + 2, blockSize);
+        mixedPosition = blockSize;
+        
+        for (int i = 1; i < numShards; ++i) {
+            shardThreads.add(new ShardRenderThread(*this));
+        }
+    }
+    
+    startThread();
 }
 
 SoundfontAudioSource::~SoundfontAudioSource()
 {
-    delete_fluid_synth(synth);
+    stopThread(4000);
+    cancelPendingUpdate();
+    
+    // Anything the audio thread never picked up or handed back
+    freeRetiredSoundfonts();
+    if (LoadedSoundfont* unused = pendingSoundfont.exchange(nullptr)) {
+        releaseSoundfont(unused);
+    }
+    
+    shardThreads.clear();
+    
+    for (int i = 0; i < numShards; ++i) {
+        // The pool owns the current soundfont, so take it off the synth's stack
+        // before the synth gets a chance to free it
+        if (currentSoundfont != nullptr) {
+            fluid_synth_remove_sfont(shards[i], currentSoundfont->handles[i]);
+        }
+        
+        // Deleting the synth turns off any voices still playing our soundfonts
+        delete_fluid_synth(shards[i]);
+    }
+    
+    if (currentSoundfont != nullptr) {
+        releaseSoundfont(currentSoundfont);
+    }
+    for (int i = 0; i < numFadingSoundfonts; ++i) {
+        releaseSoundfont(fadingSoundfonts[i]);
+    }
     delete_fluid_settings(settings);
 }
 
 void SoundfontAudioSource::prepareToPlay(int samplesPerBlockExpected, double sampleRate)
 {
-    fluid_synth_set_sample_rate(synth, (float) sampleRate);
+    for (int i = 0; i < numShards; ++i) {
+        fluid_synth_set_sample_rate(shards[i], (float) sampleRate);
+    }
 }
 
 void SoundfontAudioSource::releaseResources()
@@ -42,129 +232,748 @@ void SoundfontAudioSource::getNextAudioBlock(const AudioSourceChannelInfo& buffe
     // Remove any sounds coming in
     bufferToFill.clearActiveBufferRegion();
     
-    // Prevent loading/unloading soundfonts & stuff while writing floats.
-    // That is how you get race conditions and crashes.
-    const ScopedLock l (lock);
+    const MidiBuffer noMidi;
+    renderNextBlock(*bufferToFill.buffer, noMidi, bufferToFill.startSample, bufferToFill.numSamples);
+}
+
+void SoundfontAudioSource::renderNextBlock (AudioBuffer<float>& outputAudio, const MidiBuffer& midiData,
+                                            int startSample, int numSamples)
+{
+    // Anything loaded or queued from other threads lands at the start of the block
+    swapPendingSoundfont();
+    dispatchPendingEvents();
+    
+    // Render up to each event, apply it, and carry on from there. fluidsynth keeps
+    // its own cursor into the current 64-sample block, so splitting the render
+    // doesn't change what comes out - it just lets the event in between. The
+    // event lands at the start of the next block, or on its own sample a block
+    // later with setSampleAccurateEvents().
+    const int endSample = startSample + numSamples;
+    int position = startSample;
+    
+    MidiBuffer::Iterator iterator (midiData);
+    iterator.setNextSamplePosition(startSample);
+    
+    MidiMessage message;
+    int eventPosition;
+    
+    while (iterator.getNextEvent(message, eventPosition)) {
+        if (eventPosition >= endSample) {
+            break;
+        }
+        
+        if (eventPosition > position) {
+            renderRegion(outputAudio, position, eventPosition - position);
+            position = eventPosition;
+        }
+        
+        SynthEvent event;
+        if (createEventFromMidi(message, event)) {
+            handleEvent(event);
+        }
+    }
+    
+    if (position < endSample) {
+        renderRegion(outputAudio, position, endSample - position);
+    }
+    
+    retireUnusedSoundfonts();
+    publishControllerValues();
+}
+
+void SoundfontAudioSource::renderRegion (AudioBuffer<float>& outputAudio, int startSample, int numSamples)
+{
+    if (numShards > 1) {
+        renderShardedRegion(outputAudio, startSample, numSamples);
+        return;
+    }
+    if (outputAudio.getNumChannels() == 1) {
+        renderMonoRegion(outputAudio, startSample, numSamples);
+        return;
+    }
+    
+    // Buses that don't fit in the buffer aren't rendered into it
+    const int numOutputs = jmin(numBuses, outputAudio.getNumChannels() / 2) * 2;
+    
+    float* outputs[maxBuses * 2];
+    for (int i = 0; i < numOutputs; ++i) {
+        outputs[i] = outputAudio.getWritePointer(i, startSample);
+    }
+    
+    fluid_synth_write_float_buses(synth, numSamples, numOutputs, outputs);
+}
+
+void SoundfontAudioSource::renderShardedRegion (AudioBuffer<float>& outputAudio, int startSample, int numSamples)
+{
+    const int numOutputs = jmin(numBuses, outputAudio.getNumChannels() / 2) * 2;
+    
+    while (numSamples > 0) {
+        if (mixedPosition == blockSize) {
+            renderShardedBlock();
+            mixedPosition = 0;
+        }
+        
+        const int num = jmin(numSamples, blockSize - mixedPosition);
+        for (int i = 0; i < numOutputs; ++i) {
+            outputAudio.copyFrom(i, startSample, mixedBlock, i, mixedPosition, num);
+        }
+        if (outputAudio.getNumChannels() == 1) {
+            outputAudio.copyFrom(0, startSample, mixedBlock, 0, mixedPosition, num);
+            outputAudio.addFrom(0, startSample, mixedBlock, 1, mixedPosition, num);
+            outputAudio.applyGain(0, startSample, num, 0.5f);
+        }
+        
+        mixedPosition += num;
+        startSample += num;
+        numSamples -= num;
+    }
+}
+
+void SoundfontAudioSource::renderMonoRegion (AudioBuffer<float>& outputAudio, int startSample, int numSamples)
+{
+    // fluidsynth keeps its own cursor, so rendering in pieces changes nothing
+    float* outputs[2] = { monoBlock.getWritePointer(0), monoBlock.getWritePointer(1) };
+    
+    while (numSamples > 0) {
+        const int num = jmin(numSamples, blockSize);
+        fluid_synth_write_float_buses(synth, num, 2, outputs);
+        
+        outputAudio.copyFrom(0, startSample, monoBlock, 0, 0, num);
+        outputAudio.addFrom(0, startSample, monoBlock, 1, 0, num);
+        outputAudio.applyGain(0, startSample, num, 0.5f);
+        
+        startSample += num;
+        numSamples -= num;
+    }
+}
+
+void SoundfontAudioSource::renderShardedBlock()
+{
+    int numBusyShards = 0;
+    for (int k = 0; k < numShards; ++k) {
+        if (fluid_synth_get_active_voice_count(shards[k]) > 0) {
+            ++numBusyShards;
+        }
+    }
+    
+    nextShard.store(0, std::memory_order_relaxed);
+    
+    if (numBusyShards > 1) {
+        numBusyThreads.store(shardThreads.size(), std::memory_order_relaxed);
+        ++shardBlockNumber;
+        
+        for (ShardRenderThread* thread : shardThreads) {
+            thread->wake();
+        }
+        renderShards();
+        waitForShardThreads();
+    } else {
+        // Nothing worth sharing out - the idle synths only clear their
+        // buffers, which is quicker than waking the other threads
+        renderShards();
+    }
+    
+    // Sum in shard order, so the result doesn't depend on which thread was quickest
+    const int numChannels = mixedBlock.getNumChannels();
+    
+    for (int i = 0; i < numChannels; ++i) {
+        mixedBlock.copyFrom(i, 0, shardBlocks, i, 0, blockSize);
+    }
+    for (int k = 1; k < numShards; ++k) {
+        for (int i = 0; i < numChannels; ++i) {
+            mixedBlock.addFrom(i, 0, shardBlocks, k * numChannels + i, 0, blockSize);
+        }
+    }
     
-    fluid_synth_write_float(synth,
-                            bufferToFill.buffer->getNumSamples(),
-                            bufferToFill.buffer->getWritePointer(0), 0, 1,
-                            bufferToFill.buffer->getWritePointer(1), 0, 1);
+    fluid_synth_mix_fx(synth, blockSize,
+                       mixedBlock.getWritePointer(2 * numBuses),
+                       mixedBlock.getWritePointer(2 * numBuses + 1),
+                       mixedBlock.getWritePointer(0),
+                       mixedBlock.getWritePointer(1));
 }
 
+void SoundfontAudioSource::renderShards()
+{
+    const int numChannels = 2 * numBuses + 2;
+    
+    for (int k = nextShard++; k < numShards; k = nextShard++) {
+        float* outputs[maxBuses * 2];
+        for (int i = 0; i < 2 * numBuses; ++i) {
+            outputs[i] = shardBlocks.getWritePointer(k * numChannels + i);
+        }
+        
+        fluid_synth_write_float_sends(shards[k], blockSize, 2 * numBuses, outputs,
+                                      shardBlocks.getWritePointer(k * numChannels + 2 * numBuses),
+                                      shardBlocks.getWritePointer(k * numChannels + 2 * numBuses + 1));
+    }
+}
+
+void SoundfontAudioSource::waitForShardThreads()
+{
+    for (int spins = 0; numBusyThreads.load(std::memory_order_acquire) > 0; ++spins) {
+        if (spins < shardSpinCount) {
+            continue;
+        }
+        
+        // The last thread to finish only signals if it sees the flag, and we
+        // look at the count again after raising it, so one of us sees the other
+        waitingForShards = true;
+        if (numBusyThreads > 0) {
+            shardsFinished.wait();
+        }
+        waitingForShards = false;
+    }
+}
+
+fluid_synth_t* SoundfontAudioSource::getSynthForChannel (int channel) const
+{
+    // Channels out of range go to the first synth, which ignores them
+    return channel >= 1 ? shards[(channel - 1) % numShards] : synth;
+}
+
+//==============================================================================
+SoundfontAudioSource::ShardRenderThread::ShardRenderThread (SoundfontAudioSource& o)
+    : Thread ("Soundfont Renderer"),
+      owner (o)
+{
+    startThread (realtimeAudioPriority);
+}
+
+SoundfontAudioSource::ShardRenderThread::~ShardRenderThread()
+{
+    signalThreadShouldExit();
+    wakeUp.signal();
+    stopThread (4000);
+}
+
+void SoundfontAudioSource::ShardRenderThread::wake()
+{
+    if (sleeping) {
+        wakeUp.signal();
+    }
+}
+
+void SoundfontAudioSource::ShardRenderThread::run()
+{
+    uint32 lastBlock = owner.shardBlockNumber.load(std::memory_order_acquire);
+    
+    while (! threadShouldExit()) {
+        // Spin for a while, as the next block is usually close behind
+        uint32 block = owner.shardBlockNumber.load(std::memory_order_acquire);
+        for (int spins = 0; block == lastBlock && spins < shardSpinCount; ++spins) {
+            block = owner.shardBlockNumber.load(std::memory_order_acquire);
+        }
+        
+        if (block == lastBlock) {
+            // wake() only signals if it sees the flag, and we look at the
+            // block number again after raising it, so one of us sees the other
+            sleeping = true;
+            if (owner.shardBlockNumber == lastBlock) {
+                wakeUp.wait();
+            }
+            sleeping = false;
+            continue;
+        }
+        lastBlock = block;
+        
+        owner.renderShards();
+        
+        if (--owner.numBusyThreads == 0 && owner.waitingForShards) {
+            owner.shardsFinished.signal();
+        }
+    }
+}
+
+//==============================================================================
 bool SoundfontAudioSource::loadSoundfont(const File file)
 {
     if (file == loadedSoundfont) {
         // Don't reload an already loaded soundfont
         return false;
     }
+    if (! file.existsAsFile()) {
+        return false;
+    }
     loadedSoundfont = file;
     
-    // Lock while switching soundfonts
-    const ScopedLock l (lock);
+    // The loader thread picks this up. If it's still busy with an earlier
+    // request, only the latest one gets loaded.
+    {
+        const ScopedLock l (loaderLock);
+        requestedSoundfont = file;
+    }
+    notify();
+    return true;
+}
+
+void SoundfontAudioSource::run()
+{
+    while (! threadShouldExit()) {
+        freeRetiredSoundfonts();
+        
+        File file;
+        {
+            const ScopedLock l (loaderLock);
+            file = requestedSoundfont;
+            requestedSoundfont = File();
+        }
+        
+        if (file != File()) {
+            // This is the slow part: reading the file, decoding samples and
+            // building the presets, unless another instance already has.
+            // The synth keeps rendering meanwhile.
+            LoadedSoundfont* sfont = acquireSoundfont(file);
+            
+            if (sfont != nullptr) {
+                // Publish it. If the audio thread hasn't taken the previous one yet,
+                // it never will, so it's safe to free it here.
+                if (LoadedSoundfont* unused = pendingSoundfont.exchange(sfont, std::memory_order_acq_rel)) {
+                    releaseSoundfont(unused);
+                }
+            }
+            
+            {
+                const ScopedLock l (loaderLock);
+                finishedSoundfont = file;
+                finishedOk = sfont != nullptr;
+            }
+            triggerAsyncUpdate();
+            continue;
+        }
+        
+        // Wake up now and then to free whatever the audio thread retired
+        wait(100);
+    }
+}
+
+SoundfontAudioSource::LoadedSoundfont* SoundfontAudioSource::acquireSoundfont (const File& file)
+{
+    fluid_sfont_t* handle = pool->acquire(file, synth);
+    if (handle == nullptr) {
+        return nullptr;
+    }
     
-    // All notes off
-    fluid_synth_system_reset(synth);
+    auto* sfont = new LoadedSoundfont();
+    sfont->handles[0] = handle;
     
-    // If a soundfont is already loaded, unload the previous one (this demo doesn't go into banks, etc).
-    if (fluid_synth_sfcount(synth) > 0) {
-        int err = fluid_synth_sfunload(synth, (unsigned int) sfontID, true);
-        if (err == -1) {
-            return false;
+    for (int i = 1; i < numShards; ++i) {
+        sfont->handles[i] = pool->share(handle);
+        if (sfont->handles[i] == nullptr) {
+            releaseSoundfont(sfont);
+            return nullptr;
+        }
+    }
+    return sfont;
+}
+
+void SoundfontAudioSource::releaseSoundfont (LoadedSoundfont* sfont)
+{
+    for (int i = 0; i < numShards; ++i) {
+        if (sfont->handles[i] != nullptr) {
+            pool->release(sfont->handles[i]);
+        }
+    }
+    delete sfont;
+}
+
+bool SoundfontAudioSource::isPlaying (const LoadedSoundfont& sfont) const
+{
+    for (int i = 0; i < numShards; ++i) {
+        if (fluid_sfont_refcount(sfont.handles[i]) > 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void SoundfontAudioSource::swapPendingSoundfont()
+{
+    // Only this thread ever empties the slot, so if it's full now it stays full
+    if (pendingSoundfont.load(std::memory_order_acquire) == nullptr) {
+        return;
+    }
+    
+    if (currentSoundfont != nullptr && numFadingSoundfonts == maxRetiredSoundfonts) {
+        // Far too many soundfonts still ringing - cut them off so they can be freed
+        for (int i = 0; i < numShards; ++i) {
+            fluid_synth_system_reset(shards[i]);
+        }
+        changedChannels = ((uint32) 1 << numMidiChannels) - 1;
+        retireUnusedSoundfonts();
+        
+        if (numFadingSoundfonts == maxRetiredSoundfonts) {
+            // Nowhere to keep the current font. Leave the new one pending and
+            // try again next block, once the loader thread has freed some.
+            return;
         }
     }
     
-    // Load the soundfont, store the handle
-    sfontID = fluid_synth_sfload(synth, file.getFullPathName().toRawUTF8(), true);
-    return sfontID != -1;
+    LoadedSoundfont* sfont = pendingSoundfont.exchange(nullptr, std::memory_order_acq_rel);
+    
+    // This doesn't allocate, it just replaces the old font on each synth's stack.
+    // Voices playing the old font hold a reference to their synth's handle
+    // and carry on.
+    for (int i = 0; i < numShards; ++i) {
+        fluid_synth_swap_sfont(shards[i], currentSoundfont != nullptr ? currentSoundfont->handles[i] : nullptr,
+                               sfont->handles[i], true);
+    }
+    
+    if (currentSoundfont != nullptr) {
+        fadingSoundfonts[numFadingSoundfonts++] = currentSoundfont;
+    }
+    currentSoundfont = sfont;
+    
+    retireUnusedSoundfonts();
+}
+
+void SoundfontAudioSource::retireUnusedSoundfonts()
+{
+    for (int i = numFadingSoundfonts; --i >= 0;) {
+        LoadedSoundfont* sfont = fadingSoundfonts[i];
+        if (isPlaying(*sfont)) {
+            continue;
+        }
+        
+        int start1, size1, start2, size2;
+        retiredFifo.prepareToWrite(1, start1, size1, start2, size2);
+        if (size1 == 0) {
+            // The loader thread is behind - try again next block
+            return;
+        }
+        retiredSoundfonts[start1] = sfont;
+        retiredFifo.finishedWrite(1);
+        
+        fadingSoundfonts[i] = fadingSoundfonts[--numFadingSoundfonts];
+    }
+}
+
+void SoundfontAudioSource::publishControllerValues()
+{
+    gainValue.store(fluid_synth_get_gain(synth), std::memory_order_relaxed);
+    
+    for (int channel = 0; changedChannels != 0; ++channel, changedChannels >>= 1) {
+        if ((changedChannels & 1) == 0) {
+            continue;
+        }
+        
+        fluid_synth_t* channelSynth = getSynthForChannel(channel + 1);
+        int value = 0;
+        
+        for (int control = 0; control < 128; ++control) {
+            fluid_synth_get_cc(channelSynth, channel, control, &value);
+            ccValues[channel][control].store(value, std::memory_order_relaxed);
+        }
+        fluid_synth_get_pitch_bend(channelSynth, channel, &value);
+        pitchBendValues[channel].store(value, std::memory_order_relaxed);
+        fluid_synth_get_pitch_wheel_sens(channelSynth, channel, &value);
+        pitchBendRanges[channel].store(value, std::memory_order_relaxed);
+    }
+}
+
+void SoundfontAudioSource::freeRetiredSoundfonts()
+{
+    int start1, size1, start2, size2;
+    retiredFifo.prepareToRead(retiredFifo.getNumReady(), start1, size1, start2, size2);
+    
+    for (int i = 0; i < size1; ++i) {
+        releaseSoundfont(retiredSoundfonts[start1 + i]);
+    }
+    for (int i = 0; i < size2; ++i) {
+        releaseSoundfont(retiredSoundfonts[start2 + i]);
+    }
+    retiredFifo.finishedRead(size1 + size2);
+}
+
+void SoundfontAudioSource::handleAsyncUpdate()
+{
+    File file;
+    bool loadedOk;
+    {
+        const ScopedLock l (loaderLock);
+        file = finishedSoundfont;
+        loadedOk = finishedOk;
+    }
+    
+    if (! loadedOk && file == loadedSoundfont) {
+        // Let a later attempt at the same file try again
+        loadedSoundfont = File();
+    }
+    
+    if (onSoundfontLoaded != nullptr) {
+        onSoundfontLoaded(file, loadedOk);
+    }
 }
 
 void SoundfontAudioSource::processMidi (const MidiMessage& message)
 {
+    SynthEvent event;
+    if (createEventFromMidi(message, event) && ! events.push(event)) {
+        jassertfalse;
+    }
+}
+
+bool SoundfontAudioSource::createEventFromMidi (const MidiMessage& message, SynthEvent& event)
+{
+    event.channel = message.getChannel();
+    event.data1 = 0;
+    event.data2 = 0;
+    event.value = 0.0f;
+    event.sampleOffset = 0;
+    
     if (message.isNoteOn()) {
-        noteOn(message.getNoteNumber(), message.getVelocity());
+        event.type = SynthEvent::noteOnEvent;
+        event.data1 = message.getNoteNumber();
+        event.data2 = message.getVelocity();
     }
     else if (message.isNoteOff()) {
-        noteOff(message.getNoteNumber());
+        event.type = SynthEvent::noteOffEvent;
+        event.data1 = message.getNoteNumber();
     }
     else if (message.isController()) {
-        cc(message.getControllerNumber(), message.getControllerValue());
+        event.type = SynthEvent::controllerEvent;
+        event.data1 = message.getControllerNumber();
+        event.data2 = message.getControllerValue();
     }
     else if (message.isPitchWheel()) {
-        pitchBend(message.getPitchWheelValue());
+        event.type = SynthEvent::pitchBendEvent;
+        event.data1 = message.getPitchWheelValue();
     }
     else if (message.isChannelPressure()) {
-        channelPressure(message.getChannelPressureValue());
+        event.type = SynthEvent::channelPressureEvent;
+        event.data1 = message.getChannelPressureValue();
     }
-    // Add support for other types of MIDI messages here
+    else {
+        // Add support for other types of MIDI messages here
+        return false;
+    }
+    return true;
 }
 
 void SoundfontAudioSource::noteOn (int note, int velocity, int channel)
 {
     // Actually do note off if the velocity is 0
     velocity == 0
-        ? fluid_synth_noteoff(synth, channel, note)
-        : fluid_synth_noteon(synth, channel, note, velocity);
+        ? postEvent(SynthEvent::noteOffEvent, channel, note)
+        : postEvent(SynthEvent::noteOnEvent, channel, note, velocity);
 }
 
 void SoundfontAudioSource::noteOff (int note, int channel)
 {
-    fluid_synth_noteoff(synth, channel, note);
+    postEvent(SynthEvent::noteOffEvent, channel, note);
 }
 
 void SoundfontAudioSource::cc(int control, int value, int channel)
 {
-    fluid_synth_cc(synth, channel, control, value);
+    postEvent(SynthEvent::controllerEvent, channel, control, value);
 }
 
 int SoundfontAudioSource::getCc(int control, int channel)
 {
-    int value = 0;
-    fluid_synth_get_cc(synth, channel, control, &value);
-    return value;
+    if (! isPositiveAndBelow(channel - 1, (int) numMidiChannels) || ! isPositiveAndBelow(control, 128)) {
+        return 0;
+    }
+    return ccValues[channel - 1][control].load(std::memory_order_relaxed);
 }
 
 void SoundfontAudioSource::pitchBend(int value, int channel)
 {
-    fluid_synth_pitch_bend(synth, channel, value);
+    postEvent(SynthEvent::pitchBendEvent, channel, value);
 }
 
 int SoundfontAudioSource::getPitchBend(int channel)
 {
-    int value = 0;
-    fluid_synth_get_pitch_bend(synth, channel, &value);
-    return value;
+    if (! isPositiveAndBelow(channel - 1, (int) numMidiChannels)) {
+        return 0;
+    }
+    return pitchBendValues[channel - 1].load(std::memory_order_relaxed);
 }
 
 void SoundfontAudioSource::setPitchBendRange(int value, int channel)
 {
-    fluid_synth_pitch_wheel_sens(synth, channel, value);
+    postEvent(SynthEvent::pitchBendRangeEvent, channel, value);
 }
 
 int SoundfontAudioSource::getPitchBendRange(int channel)
 {
-    int value = 0;
-    fluid_synth_get_pitch_wheel_sens(synth, channel, &value);
-    return value;
+    if (! isPositiveAndBelow(channel - 1, (int) numMidiChannels)) {
+        return 0;
+    }
+    return pitchBendRanges[channel - 1].load(std::memory_order_relaxed);
 }
 
 void SoundfontAudioSource::channelPressure(int value, int channel)
 {
-    fluid_synth_channel_pressure(synth, channel, value);
+    postEvent(SynthEvent::channelPressureEvent, channel, value);
 }
 
 void SoundfontAudioSource::setGain (float gain)
 {
-    fluid_synth_set_gain(synth, gain);
+    postEvent(SynthEvent::gainEvent, 0, 0, 0, gain);
 }
 
 float SoundfontAudioSource::getGain()
 {
-    return fluid_synth_get_gain(synth);
+    return gainValue.load(std::memory_order_relaxed);
+}
+
+void SoundfontAudioSource::setControllerCoalescing (bool shouldCoalesce)
+{
+    postEvent(SynthEvent::coalescingEvent, 0, shouldCoalesce ? 1 : 0);
+}
+
+void SoundfontAudioSource::setSampleAccurateEvents (bool shouldBeSampleAccurate)
+{
+    postEvent(SynthEvent::eventTimingEvent, 0, shouldBeSampleAccurate ? 1 : 0);
 }
 
 void SoundfontAudioSource::systemReset()
 {
-    fluid_synth_system_reset(synth);
+    postEvent(SynthEvent::resetEvent, 0);
+}
+
+//==============================================================================
+void SoundfontAudioSource::postEvent (SynthEvent::Type type, int channel, int data1, int data2, float value)
+{
+    SynthEvent event;
+    event.type = type;
+    event.channel = channel;
+    event.data1 = data1;
+    event.data2 = data2;
+    event.value = value;
+    event.sampleOffset = 0;
+    
+    if (! events.push (event)) {
+        // The audio thread isn't keeping up (or isn't running) - the event is lost
+        jassertfalse;
+    }
 }
 
+void SoundfontAudioSource::dispatchPendingEvents()
+{
+    SynthEvent event;
+    while (events.pop (event)) {
+        handleEvent (event);
+    }
+}
+
+void SoundfontAudioSource::handleEvent (const SynthEvent& event)
+{
+    // The shards only ever render whole blocks, so their own cursors say
+    // nothing about where the event is; the mixed block's position does
+    if (sampleAccurateEvents && numShards > 1) {
+        fluid_synth_set_event_offset(getSynthForChannel(event.channel), mixedPosition);
+    }
+    
+    // Only these can change what the getters report
+    if (event.type == SynthEvent::controllerEvent || event.type == SynthEvent::pitchBendEvent
+        || event.type == SynthEvent::pitchBendRangeEvent) {
+        if (isPositiveAndBelow(event.channel - 1, (int) numMidiChannels)) {
+            changedChannels |= (uint32) 1 << (event.channel - 1);
+        }
+    }
+    else if (event.type == SynthEvent::resetEvent) {
+        changedChannels = ((uint32) 1 << numMidiChannels) - 1;
+    }
+    
+    switch (event.type)
+    {
+        case SynthEvent::noteOnEvent:
+            fluid_synth_noteon(getSynthForChannel(event.channel), event.channel - 1, event.data1, event.data2);
+            break;
+        case SynthEvent::noteOffEvent:
+            fluid_synth_noteoff(getSynthForChannel(event.channel), event.channel - 1, event.data1);
+            break;
+        case SynthEvent::controllerEvent:
+            fluid_synth_cc(getSynthForChannel(event.channel), event.channel - 1, event.data1, event.data2);
+            break;
+        case SynthEvent::pitchBendEvent:
+            fluid_synth_pitch_bend(getSynthForChannel(event.channel), event.channel - 1, event.data1);
+            break;
+        case SynthEvent::pitchBendRangeEvent:
+            fluid_synth_pitch_wheel_sens(getSynthForChannel(event.channel), event.channel - 1, event.data1);
+            break;
+        case SynthEvent::channelPressureEvent:
+            fluid_synth_channel_pressure(getSynthForChannel(event.channel), event.channel - 1, event.data1);
+            break;
+        case SynthEvent::gainEvent:
+            for (int i = 0; i < numShards; ++i) {
+                fluid_synth_set_gain(shards[i], event.value);
+            }
+            break;
+        case SynthEvent::coalescingEvent:
+            for (int i = 0; i < numShards; ++i) {
+                fluid_synth_set_coalesce_controllers(shards[i], event.data1);
+            }
+            break;
+        case SynthEvent::eventTimingEvent:
+            // A synth rendering straight into the output follows its own cursor
+            sampleAccurateEvents = event.data1 != 0;
+            for (int i = 0; i < numShards; ++i) {
+                fluid_synth_set_event_offset(shards[i], sampleAccurateEvents && numShards == 1 ? -1 : 0);
+            }
+            break;
+        case SynthEvent::resetEvent:
+            for (int i = 0; i < numShards; ++i) {
+                fluid_synth_system_reset(shards[i]);
+            }
+            break;
+        default:
+            break;
+    }
+}
+
+//==============================================================================
+// Bounded MPMC ring after Dmitry Vyukov, with a single consumer. Each cell
+// carries a sequence number that tells producers and the consumer whose
+// turn it is, so a slow producer can never expose a half-written event.
+SoundfontAudioSource::EventQueue::EventQueue()
+    : cells ((size_t) capacity)
+{
+    for (uint32 i = 0; i < (uint32) capacity; ++i) {
+        new (&cells[i].sequence) std::atomic<uint32> (i);
+    }
+}
+
+bool SoundfontAudioSource::EventQueue::push (const SynthEvent& event) noexcept
+{
+    uint32 position = writePosition.load (std::memory_order_relaxed);
+    
+    for (;;) {
+        Cell& cell = cells[position & (capacity - 1)];
+        const uint32 sequence = cell.sequence.load (std::memory_order_acquire);
+        const int32 difference = (int32) (sequence - position);
+        
+        if (difference == 0) {
+            // The cell is free - try to claim it
+            if (writePosition.compare_exchange_weak (position, position + 1, std::memory_order_relaxed)) {
+                cell.event = event;
+                cell.sequence.store (position + 1, std::memory_order_release);
+                return true;
+            }
+        }
+        else if (difference < 0) {
+            // Full
+            return false;
+        }
+        else {
+            // Another producer got here first
+            position = writePosition.load (std::memory_order_relaxed);
+        }
+    }
+}
+
+bool SoundfontAudioSource::EventQueue::pop (SynthEvent& event) noexcept
+{
+    Cell& cell = cells[readPosition & (capacity - 1)];
+    const uint32 sequence = cell.sequence.load (std::memory_order_acquire);
+    
+    if ((int32) (sequence - (readPosition + 1)) < 0) {
+        // Empty, or the producer hasn't finished writing this cell yet
+        return false;
+    }
+    
+    event = cell.event;
+    cell.sequence.store (readPosition + capacity, std::memory_order_release);
+    ++readPosition;
+    return true;
+}
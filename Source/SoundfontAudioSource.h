@@ -12,19 +12,124 @@
 
 #include "../JuceLibraryCode/JuceHeader.h"
 #include "Fluidlite/include/fluidlite.h"
+#include <atomic>
+
+//==========================================================================
+//==========================================================================
+/** A process-wide cache of loaded soundfonts.
+    Every SoundfontAudioSource shares one of these (through a SharedResourcePointer),
+    so a file that is used by several of them is only read and decoded once.
+    Each user gets its own lightweight handle onto the same samples and presets.
+    Files are keyed by their canonical path and modification time, so an edited
+    file is loaded afresh while the old copy stays around for the handles using it.
+ */
+class SoundfontPool
+{
+public:
+    
+    SoundfontPool();
+    
+    /** Frees whatever is still loaded. All handles must have been released. */
+    ~SoundfontPool();
+    
+    /** Returns a new handle onto the given file, loading it with the synth's
+        soundfont loaders if it isn't in the pool yet. Returns nullptr if it
+        can't be loaded. Safe to call from any thread. */
+    fluid_sfont_t* acquire (const File& file, fluid_synth_t* synth);
+    
+    /** Returns another handle onto the soundfont an existing handle from this
+        pool was made from, or nullptr if it can't be made. Safe to call from
+        any thread. */
+    fluid_sfont_t* share (fluid_sfont_t* handle);
+    
+    /** Frees a handle returned by acquire() or share(). The shared data goes
+        when its last handle does. No voice may still be playing from the handle. */
+    void release (fluid_sfont_t* handle);
+    
+private:
+    
+    struct Entry
+    {
+        String path;
+        Time modificationTime;
+        fluid_sfont_t* sfont;
+        int numHandles;
+    };
+    
+    /** Returns the absolute path of a file with every symbolic link, "." and
+        ".." resolved, so that each file has only one. */
+    static String getCanonicalPath (const File& file);
+    
+    /** Both of these must be called with the lock held. */
+    Entry* findEntry (const String& path, Time modificationTime);
+    fluid_sfont_t* createHandle (Entry& entry);
+    
+    CriticalSection lock;
+    OwnedArray<Entry> entries;
+    HashMap<fluid_sfont_t*, Entry*> handleEntries;   // the entry each handle was made from
+    
+    JUCE_DECLARE_NON_COPYABLE (SoundfontPool)
+};
 
 //==========================================================================
 //==========================================================================
 /** This uses the Fluidlite library to load soundfont files and play them.
     By default it uses MIDI channel 1, though you can optionally specify a channel.
     To inspect or create soundfont files, I recommend the "Polyphone" app.
+ 
+    The control methods (noteOn, cc, setGain etc.) can be called from any thread.
+    They never touch the synth directly: each call is pushed onto a lock-free
+    queue which the audio thread drains at the start of getNextAudioBlock().
+    If the queue is full (the audio thread isn't running or can't keep up) the
+    call asserts in debug builds and the message is dropped.
+    The getters (getCc, getGain etc.) read copies that the audio thread makes
+    after each block, so a value that has just been set isn't reflected until
+    the next block has been rendered.
+ 
+    Soundfonts are loaded on a background thread and swapped in between two
+    audio blocks, so switching instruments never stalls the audio thread.
+    Notes that are still ringing keep playing from the old soundfont, which
+    is freed once the last of them has finished. Soundfonts are shared with
+    every other SoundfontAudioSource through a SoundfontPool.
+ 
+    Rendering can be spread over several threads, either by splitting the
+    voices of one synth between them, or by giving each thread its own synth
+    that plays a share of the MIDI channels (see RenderMode).
  */
-class SoundfontAudioSource   :   public AudioSource
+class SoundfontAudioSource   :   public AudioSource,
+                                 private Thread,
+                                 private AsyncUpdater
 {
 public:
     
-    /** Initializes fluidsynth. */
-    SoundfontAudioSource(int numberOfVoices = 256);
+    /** How the work is split when there is more than one render thread. */
+    enum RenderMode
+    {
+        /** One synth, whose voices are shared out between the threads in
+            fixed shares. For a given number of threads the output doesn't
+            depend on timing, but it is rounded differently from a single
+            thread's (by at most 5e-7 on the bundled soundfonts). */
+        splitVoices,
+        
+        /** One synth per thread. MIDI channel n is played by synth
+            (n - 1) % numberOfRenderThreads, and the synths render side by
+            side with hardly any synchronisation. Their output is summed and
+            goes through a single reverb and chorus. Best for multitimbral
+            material such as General MIDI files. */
+        splitChannels
+    };
+    
+    /** Initializes fluidsynth.
+        With more than one bus, each MIDI channel gets its own stereo pair in the
+        output buffer: channel 1 goes to outputs 0 and 1, channel 2 to outputs
+        2 and 3, and so on, wrapping around after numberOfBuses. The reverb and
+        chorus are mixed into the first bus. At most 16 buses are supported.
+        With more than one render thread, the audio thread renders together with
+        numberOfRenderThreads - 1 helper threads, sharing the work as set by
+        renderMode. At most 16 threads are used in splitChannels mode, where
+        numberOfVoices is the polyphony of each synth. */
+    SoundfontAudioSource(int numberOfVoices = 256, int numberOfBuses = 1,
+                         int numberOfRenderThreads = 1, RenderMode renderMode = splitVoices);
     
     /** Destructor */
     ~SoundfontAudioSource();
@@ -34,35 +139,57 @@ public:
     void releaseResources() override;
     void getNextAudioBlock (const AudioSourceChannelInfo& bufferToFill) override;
     
-    /** Load a .sf2 file. Will not reload a file if it is already loaded.
-        If another file is loaded, it will unload that first. */
+    /** Renders a region of the buffer, applying each MIDI event at its exact
+        sample position rather than at the start of the block. The buffer needs
+        two channels per bus; buses that don't fit are not rendered. A mono
+        buffer gets the first bus, with its left and right averaged.
+        Event positions are sample indexes into outputAudio, as with
+        Synthesiser::renderNextBlock(). Events outside the region are ignored.
+        The render is split at each event, but note-ons and note-offs still
+        take effect at the start of the synth's next 64-sample block, so they
+        are rounded to 64 samples, unless setSampleAccurateEvents() is on.
+        The region is overwritten, not mixed into. */
+    void renderNextBlock (AudioBuffer<float>& outputAudio, const MidiBuffer& midiData,
+                          int startSample, int numSamples);
+    
+    /** Load a .sf2 file in the background. Will not reload a file if it is already loaded.
+        Once loaded, it replaces the previous soundfont at the start of the next
+        audio block. Returns true if a load was queued, false if the file doesn't
+        exist or is already loaded; other errors are reported through
+        onSoundfontLoaded. */
     bool loadSoundfont (const File file);
     
+    /** Called on the message thread when a soundfont requested with loadSoundfont()
+        has finished loading, or failed to. */
+    std::function<void (const File& file, bool loadedOk)> onSoundfontLoaded;
+    
     /** Sends an incoming midi message to fluidsynth */
     void processMidi (const MidiMessage& message);
     
-    /** Send a noteon message. */
+    /** Send a noteon message. Here and in the other channel methods, MIDI
+        channels are numbered from 1 to 16, as in MidiMessage; channel 0 and
+        channels above 16 are ignored. */
     void noteOn (int note, int velocity, int channel = 1);
     
-    /** Send a noteoff message. */
+    /** Send a noteoff message. The channel is 1-based. */
     void noteOff (int note, int channel = 1);
     
-    /** Send a continuous controller message. */
+    /** Send a continuous controller message. The channel is 1-based. */
     void cc (int control, int value, int channel = 1);
     
-    /** Get a continuous controller value. */
+    /** Get a continuous controller value, as of the last rendered block. */
     int getCc (int control, int channel = 1);
     
     /** Send a pitch bend message. */
     void pitchBend (int value, int channel = 1);
     
-    /** Get the current pitch bend value. */
+    /** Get the pitch bend value, as of the last rendered block. */
     int getPitchBend (int channel = 1);
     
     /** Set the pitch wheel sensitivity. */
     void setPitchBendRange (int value, int channel = 1);
     
-    /** Get the pitch wheel sensitivity. */
+    /** Get the pitch wheel sensitivity, as of the last rendered block. */
     int getPitchBendRange (int channel = 1);
     
     /** Send a channel pressure message. */
@@ -71,14 +198,34 @@ public:
     /** Set the fluidsynth gain */
     void setGain (float gain);
     
-    /** Get the fluidsynth gain */
+    /** Get the fluidsynth gain, as of the last rendered block. */
     float getGain();
     
+    /** When on, controller, pitch bend and channel pressure messages only
+        take effect at the start of the synth's next 64-sample block, and
+        only the last value of each is applied. This sounds the same, since
+        the synth only updates its voices once per block anyway, and saves
+        a lot of work when a controller sends many messages per block.
+        Off by default. */
+    void setControllerCoalescing (bool shouldCoalesce);
+    
+    /** When on, notes start and stop on the exact sample of their MIDI
+        message instead of at the start of the synth's next 64-sample
+        block, at the cost of one block (about 1.5ms) of extra latency.
+        That covers releases too: note-offs, the sustain pedal and all
+        notes off. Off by default. */
+    void setSampleAccurateEvents (bool shouldBeSampleAccurate);
+    
     /** Send a reset. A reset turns all the notes off and resets the
         controller values. */
     void systemReset();
     
-    /** Returns the raw fluid_synth_t object for direct use with the Fluidsynth API. */
+    /** Returns the number of stereo buses, as given to the constructor. */
+    int getNumBuses() const         { return numBuses; }
+    
+    /** Returns the raw fluid_synth_t object for direct use with the Fluidsynth API.
+        In splitChannels mode this is the synth playing MIDI channel 1, which
+        also runs the reverb and chorus. */
     fluid_synth_t* getSynth()       { return synth; }
     
     /** Returns the raw settings for use with the Fluidsynth API. */
@@ -86,9 +233,223 @@ public:
     
 private:
     
-    CriticalSection lock;
+    //==========================================================================
+    /** A control message waiting to be applied to the synth on the audio thread. */
+    struct SynthEvent
+    {
+        enum Type
+        {
+            noteOnEvent,
+            noteOffEvent,
+            controllerEvent,
+            pitchBendEvent,
+            pitchBendRangeEvent,
+            channelPressureEvent,
+            gainEvent,
+            coalescingEvent,
+            eventTimingEvent,
+            resetEvent
+        };
+        
+        Type type;
+        int channel;            // 1-16, as in MidiMessage
+        int data1;
+        int data2;
+        float value;
+        
+        /** Position of the event within the block it is rendered in. */
+        int sampleOffset;
+    };
+    
+    //==========================================================================
+    /** A bounded multi-producer, single-consumer FIFO of SynthEvents.
+        Any thread may push; only the audio thread may pop. Neither side
+        ever blocks or allocates.
+     */
+    class EventQueue
+    {
+    public:
+        EventQueue();
+        
+        /** Returns false if the queue is full and the event was dropped. */
+        bool push (const SynthEvent& event) noexcept;
+        
+        /** Returns false if there was nothing to pop. */
+        bool pop (SynthEvent& event) noexcept;
+        
+    private:
+        enum { capacity = 4096 };   // must be a power of two
+        
+        struct Cell
+        {
+            std::atomic<uint32> sequence;
+            SynthEvent event;
+        };
+        
+        HeapBlock<Cell> cells;
+        std::atomic<uint32> writePosition { 0 };
+        uint32 readPosition = 0;
+        
+        JUCE_DECLARE_NON_COPYABLE (EventQueue)
+    };
+    
+    /** Queues an event for the audio thread. */
+    void postEvent (SynthEvent::Type type, int channel, int data1 = 0, int data2 = 0, float value = 0.0f);
+    
+    /** Converts the MIDI messages we understand into an event. Returns false
+        for anything else. */
+    static bool createEventFromMidi (const MidiMessage& message, SynthEvent& event);
+    
+    //==========================================================================
+    /** Renders synths alongside the audio thread in splitChannels mode. */
+    class ShardRenderThread  : public Thread
+    {
+    public:
+        ShardRenderThread (SoundfontAudioSource& owner);
+        ~ShardRenderThread();
+        
+        /** Called by the audio thread after starting a block, in case the
+            thread has stopped looking for one and gone to sleep. */
+        void wake();
+        
+    private:
+        void run() override;
+        
+        SoundfontAudioSource& owner;
+        WaitableEvent wakeUp;
+        std::atomic<bool> sleeping { false };
+        
+        JUCE_DECLARE_NON_COPYABLE (ShardRenderThread)
+    };
+    
+    /** Renders straight into the buffer without touching the event queue. */
+    void renderRegion (AudioBuffer<float>& outputAudio, int startSample, int numSamples);
+    
+    /** renderRegion() for splitChannels mode. The synths render whole blocks,
+        which are handed out from mixedBlock. */
+    void renderShardedRegion (AudioBuffer<float>& outputAudio, int startSample, int numSamples);
+    
+    /** renderRegion() for a mono buffer. Bus 0 is rendered a block at a time
+        into monoBlock and folded down into channel 0. */
+    void renderMonoRegion (AudioBuffer<float>& outputAudio, int startSample, int numSamples);
+    
+    /** Renders one block on every synth, sums them and runs the effects. */
+    void renderShardedBlock();
+    
+    /** Waits for the ShardRenderThreads to finish the block: spins for a
+        while, since they usually finish together with the audio thread,
+        and sleeps after that. Audio thread only. */
+    void waitForShardThreads();
+    
+    /** Renders synths until there are none left for this block. Called on the
+        audio thread and the ShardRenderThreads at the same time. */
+    void renderShards();
+    
+    /** Returns the synth that plays a MIDI channel. */
+    fluid_synth_t* getSynthForChannel (int channel) const;
+    
+    /** Applies a single event to the synth. Audio thread only. */
+    void handleEvent (const SynthEvent& event);
+    
+    /** Applies every queued event to the synth. Audio thread only. */
+    void dispatchPendingEvents();
+    
+    struct LoadedSoundfont;
+    
+    /** Gets a handle onto the file from the pool for every shard. Returns
+        nullptr if it can't be loaded. Loader thread only. */
+    LoadedSoundfont* acquireSoundfont (const File& file);
+    
+    /** Gives the handles back to the pool. Loader thread, or once the audio
+        thread has stopped. */
+    void releaseSoundfont (LoadedSoundfont* sfont);
+    
+    /** True while a voice of any shard is playing from the soundfont. */
+    bool isPlaying (const LoadedSoundfont& sfont) const;
+    
+    /** Swaps in a freshly loaded soundfont, if there is one. If every slot for
+        replaced soundfonts is still taken, even after cutting off all voices,
+        it stays pending until a later block. Audio thread only. */
+    void swapPendingSoundfont();
+    
+    /** Hands any replaced soundfont that no voice is playing any more over to
+        the loader thread. Audio thread only. */
+    void retireUnusedSoundfonts();
+    
+    /** Copies the values the getters report out of the synths, for the channels
+        whose values may have changed. Audio thread only. */
+    void publishControllerValues();
+    
+    /** Frees the soundfonts the audio thread has finished with. Loader thread only. */
+    void freeRetiredSoundfonts();
+    
+    /** Thread - loads the requested soundfonts. */
+    void run() override;
+    
+    /** AsyncUpdater - reports finished loads on the message thread. */
+    void handleAsyncUpdate() override;
+    
+    enum { maxBuses = 16, maxShards = 16, numMidiChannels = 16 };
+    
+    // How many times a thread checks on the others before going to sleep
+    enum { shardSpinCount = 4096 };
+    
+    /** A soundfont as the synths play it: a handle per shard, so that each
+        synth has its own preset handles and counts its own voices. */
+    struct LoadedSoundfont
+    {
+        fluid_sfont_t* handles[maxShards];
+    };
+    
+    SharedResourcePointer<SoundfontPool> pool;
+    const int numBuses;
+    EventQueue events;
     fluid_settings_t* settings;
     fluid_synth_t* synth;
-    int sfontID;
+    
+    // splitChannels mode. shards[0] is synth; the others are kept in step
+    // with it, and each plays its own handle onto the current soundfont.
+    fluid_synth_t* shards[maxShards];
+    int numShards = 1;
+    OwnedArray<ShardRenderThread> shardThreads;
+    std::atomic<uint32> shardBlockNumber { 0 };     // counts the blocks the threads were started on
+    std::atomic<int> nextShard { 0 };               // the next shard to render in this block
+    std::atomic<int> numBusyThreads { 0 };
+    std::atomic<bool> waitingForShards { false };   // the audio thread is asleep on shardsFinished
+    WaitableEvent shardsFinished;
+    int blockSize = 0;
+    AudioBuffer<float> shardBlocks;     // dry buses, then reverb and chorus sends, per shard
+    AudioBuffer<float> mixedBlock;      // the same, summed over the shards
+    AudioBuffer<float> monoBlock;       // bus 0, for a mono output buffer
+    int mixedPosition = 0;
+    
+    // Message thread
     File loadedSoundfont;
+    
+    // Shared between the message and loader threads
+    CriticalSection loaderLock;
+    File requestedSoundfont;
+    File finishedSoundfont;
+    bool finishedOk = false;
+    
+    // Handed from the loader thread to the audio thread
+    std::atomic<LoadedSoundfont*> pendingSoundfont { nullptr };
+    
+    // Handed from the audio thread back to the loader thread
+    enum { maxRetiredSoundfonts = 16 };
+    AbstractFifo retiredFifo { maxRetiredSoundfonts };
+    LoadedSoundfont* retiredSoundfonts[maxRetiredSoundfonts];
+    
+    // Audio thread
+    LoadedSoundfont* currentSoundfont = nullptr;
+    LoadedSoundfont* fadingSoundfonts[maxRetiredSoundfonts];
+    int numFadingSoundfonts = 0;
+    bool sampleAccurateEvents = false;
+    uint32 changedChannels = 0;         // bit n - 1 set if channel n needs publishing
+    
+    // Published by the audio thread for the getters
+    std::atomic<int> ccValues[numMidiChannels][128];
+    std::atomic<int> pitchBendValues[numMidiChannels];
+    std::atomic<int> pitchBendRanges[numMidiChannels];
+    std::atomic<float> gainValue { 1.0f };
 };